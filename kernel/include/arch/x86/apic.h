@@ -0,0 +1,36 @@
+#pragma once
+#ifndef X86_APIC_H
+#define X86_APIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Vectors we send to other CPUs, above anything a device gets
+#define IPI_TLB_SHOOTDOWN   0xF0
+#define LAPIC_SPURIOUS      0xFF
+
+/**
+ * Enable the calling CPU's local APIC, in x2APIC mode when the CPU has it,
+ * and mark the CPU online. Every CPU runs it once; needs kmap() for xAPIC.
+ */
+void lapicInit();
+
+/**
+ * APIC ID of the calling CPU.
+ */
+uint32_t lapicID();
+
+/**
+ * Send a fixed interrupt to another CPU.
+ *
+ * @param cpu: Target, as cpuGetID() numbers it there
+ * @param vector: IDT vector to raise
+ */
+void lapicSendIPI(uint32_t cpu, uint8_t vector);
+
+/**
+ * Signal end of interrupt; every handler of an APIC interrupt must call it.
+ */
+void lapicEOI();
+
+#endif
\ No newline at end of file
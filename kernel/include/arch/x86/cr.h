@@ -0,0 +1,35 @@
+#pragma once
+#ifndef X86_CR_H
+#define X86_CR_H
+
+#include <stdint.h>
+
+#define CR3_PCID_MASK   0xFFFULL
+#define CR3_NOFLUSH     (1ULL << 63)    // keep the PCID's TLB entries on load
+
+enum CR4Bits {
+    CR4_PGE             = 1 << 7,
+    CR4_PCIDE           = 1 << 17
+};
+
+static inline uint64_t readCR3() {
+    uint64_t value;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void writeCR3(uint64_t value) {
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint64_t readCR4() {
+    uint64_t value;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void writeCR4(uint64_t value) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+#endif
\ No newline at end of file
@@ -58,6 +58,7 @@ struct UserInterruptFrame {
 #endif
 
 void exceptionHandler(struct InterruptFrame *frame);
+void pageFaultHandler(struct InterruptFrame *frame);
 void irqHandler(struct InterruptFrame *frame); 
 void registerInterruptHandler(uint8_t irq, void (*handler)(struct InterruptFrame *));
 
@@ -0,0 +1,35 @@
+#pragma once
+#ifndef X86_MSR_H
+#define X86_MSR_H
+
+#include <stdint.h>
+
+enum MSR {
+    MSR_APIC_BASE       = 0x1B,
+    MSR_X2APIC_BASE     = 0x800,    // x2APIC register n lives at MSR_X2APIC_BASE + n / 16
+    MSR_EFER            = 0xC0000080
+};
+
+enum APICBaseBits {
+    APIC_BASE_X2APIC    = 1 << 10,
+    APIC_BASE_ENABLE    = 1 << 11
+};
+
+enum EFERBits {
+    EFER_SCE            = 1 << 0,
+    EFER_LME            = 1 << 8,
+    EFER_LMA            = 1 << 10,
+    EFER_NXE            = 1 << 11
+};
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+#endif
\ No newline at end of file
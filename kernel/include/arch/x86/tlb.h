@@ -0,0 +1,89 @@
+#pragma once
+#ifndef X86_TLB_H
+#define X86_TLB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct AddressSpace;
+struct Spinlock;
+
+// Past this many pages one CR3 reload is cheaper than invlpg on each
+#define TLB_FLUSH_THRESHOLD 32
+
+// PCIDs handed out per CPU before a new generation starts; 0 is left to boot
+#define TLB_PCID_COUNT 4096
+
+// Frames and page tables a batch holds back until the flush
+#define TLB_BATCH_RELEASE 64
+
+struct TLBRelease {
+    void *paddr;
+    uint32_t vmFlags;   // VM_ANON frame of a mapping with these flags; 0 for a page table
+};
+
+/**
+ * Page table changes waiting for one TLB flush.
+ * Entries are queued while page tables are edited; frames and tables they
+ * pointed to are only released after the flush, so nothing can reach a page
+ * that has been handed out again.
+ */
+struct TLBBatch {
+    struct AddressSpace *as;
+    size_t count;           // addresses in vaddrs
+    bool full;              // went past TLB_FLUSH_THRESHOLD: reload CR3 instead
+    uintptr_t vaddrs[TLB_FLUSH_THRESHOLD];
+    size_t releaseCount;
+    struct TLBRelease release[TLB_BATCH_RELEASE];
+};
+
+/**
+ * Drop this CPU's translation of vaddr. Other CPUs keep theirs; only for
+ * mappings no other CPU can have used.
+ */
+static inline void invlpg(uintptr_t vaddr) {
+    __asm__ volatile ("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
+/**
+ * Take TLB shootdown IPIs and turn on PCIDs when the CPU has them. Runs on
+ * every CPU, with a CR3 that uses PCID 0. Flushes reach other CPUs once
+ * their local APIC is up (lapicInit()).
+ */
+void tlbInit();
+
+/**
+ * Take lock, answering TLB shootdowns while spinning. Code that may run with
+ * interrupts off must take a lock this way if its holder can flush: the
+ * holder waits for every CPU's ack before it lets go.
+ */
+void tlbSpinLock(struct Spinlock *lock);
+
+/**
+ * Load as into CR3. With PCIDs, an address space that still owns its PCID
+ * on this CPU keeps its TLB entries; a fresh PCID is flushed as it loads.
+ */
+void tlbLoad(struct AddressSpace *as);
+
+void tlbBatchInit(struct TLBBatch *batch, struct AddressSpace *as);
+
+/**
+ * Queue the translation of vaddr (any address inside a large page will do).
+ */
+void tlbBatchAdd(struct TLBBatch *batch, uintptr_t vaddr);
+
+/**
+ * Release paddr once the batch has been flushed: a VM_ANON frame loses a
+ * reference, a page table (vmFlags 0) is freed. Flushes early when full.
+ */
+void tlbBatchRelease(struct TLBBatch *batch, void *paddr, uint32_t vmFlags);
+
+/**
+ * Invalidate everything queued, on this CPU and in one IPI round on every
+ * other CPU that may cache it, then release the held back pages. The batch
+ * can be reused afterwards.
+ */
+void tlbBatchFlush(struct TLBBatch *batch);
+
+#endif
\ No newline at end of file
@@ -1,7 +1,12 @@
 #ifndef ARCH_HOOK_H
 #define ARCH_HOOK_H
 
+#include <stdint.h>
+
 void archEarlyInit();
 void archPostInit();
 
+// Free-running per-CPU cycle counter, for rough measurements only
+uint64_t archCycleCounter();
+
 #endif
\ No newline at end of file
@@ -4,8 +4,13 @@
 
 #include <stdint.h>
 
+#define CPU_MAX 64 // upper bound for per-CPU arrays; cpuGetID() < CPU_MAX
+
 extern uint32_t cpuCount;
 extern uint32_t *cpuIDs;
+extern volatile uint64_t cpuOnlineMask; // bit cpuGetID() of every CPU taking IPIs
+
+_Static_assert(CPU_MAX <= 64, "cpuOnlineMask has a bit per CPU");
 
 static inline uint32_t cpuGetID() {
     return cpuIDs[0];
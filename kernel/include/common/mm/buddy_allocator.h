@@ -21,6 +21,7 @@ struct FreeBlock {
 struct Buddy {
     struct FreeList freeLists[BUDDY_MAX_ORDER];
     uint8_t *pageOrders;
+    uint32_t *pageRefs;     // extra references to each page, 0 while it has one owner
     uintptr_t base;
     size_t length;
     size_t totalPages;
@@ -30,6 +31,8 @@ struct Buddy {
 void *buddyAlloc(struct Zone *zone, size_t order);
 void *buddyAllocAligned(struct Zone *zone, size_t order, size_t align);
 void buddyFree(struct Zone *self, void *vaddr);
+uintptr_t buddyBlockBase(struct Zone *zone, uintptr_t phys);
+size_t buddyBlockPages(struct Zone *zone, uintptr_t phys);
 void buddyDump(struct Buddy *b);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <stdint.h>
+
+struct AddressSpace;
+
+/**
+ * What the faulting access was, independent of the architecture's error code.
+ */
+enum FaultFlags {
+    FAULT_PRESENT   = 1 << 0, // the page was mapped; the access broke its protection
+    FAULT_WRITE     = 1 << 1,
+    FAULT_USER      = 1 << 2, // raised from user mode
+    FAULT_EXEC      = 1 << 3  // instruction fetch
+};
+
+enum FaultResult {
+    FAULT_HANDLED,      // retry the access
+    FAULT_NOT_MAPPED,   // no mapping covers the address
+    FAULT_ACCESS,       // the mapping doesn't allow this access
+    FAULT_NO_MEMORY     // a page was needed and none was left
+};
+
+/**
+ * Try to resolve a fault at addr in as: back a lazily-mapped page on first
+ * touch, or copy a VM_PRIVATE page on the first write after a clone. Addresses in the kernel half are looked up in kernelAddressSpace.
+ *
+ * @param flags: Combination of FaultFlags
+ * @return FAULT_HANDLED if the access can be retried
+ */
+enum FaultResult vmmHandleFault(struct AddressSpace *as, uintptr_t addr, uint32_t flags);
+
+const char *faultResultName(enum FaultResult result);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <macros.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Huge pages set aside at boot, so MAP_HUGE_2MB/MAP_HUGE_1GB mappings don't
+ * depend on how fragmented the buddy allocator is by then.
+ * 2 MiB pages are taken from the buddy right after it comes up; 1 GiB pages
+ * are larger than any buddy block, so they are carved out of the memory map
+ * before the buddy sees it.
+ */
+#ifndef HUGEPAGE_POOL_2MB
+#define HUGEPAGE_POOL_2MB 8
+#endif
+
+#ifndef HUGEPAGE_POOL_1GB
+#define HUGEPAGE_POOL_1GB 0
+#endif
+
+/**
+ * Take the 1 GiB pages out of memmap.usable. Must run before pmmInit().
+ */
+__init void hugePoolCarve();
+
+/**
+ * Reserve the 2 MiB pages from the buddy. Must run after pmmInit().
+ */
+__init void hugePoolInit();
+
+/**
+ * Map the 1 GiB pages into the HHDM, which only covers usable memory.
+ * Called while vmmInit() builds the kernel page tables.
+ */
+__init void hugePoolMap();
+
+/**
+ * Take a page from the pool. It comes with one reference and is not zeroed.
+ *
+ * @param size: SIZE_2MB or SIZE_1GB
+ * @return physical address, or NULL if that pool is empty
+ */
+void *hugePageAlloc(size_t size);
+
+/**
+ * Reference counting, as pageGet()/pagePut(); the last put returns the page
+ * to its pool.
+ *
+ * @return hugePagePut(): true if the page went back to the pool
+ */
+void hugePageGet(void *paddr);
+bool hugePagePut(void *paddr);
+size_t hugePageRefCount(void *paddr);
+
+/**
+ * Free pages left of the given size.
+ */
+size_t hugePoolAvailable(size_t size);
+
+#endif
\ No newline at end of file
@@ -27,7 +27,8 @@ enum KMapFlags {
  * Returns a kernel virtual address that maps the given physical address.
  *
  * @param paddr: Physical address to map
- * @param vaddr: Virtual address to map
+ * @param vaddr: Virtual address to map, or 0 to pick a free one from the
+ *               kernel dynamic window
  * @param size: Size in bytes
  * @return virtual address in kernel space
  */
@@ -46,6 +47,10 @@ void *kmap(uintptr_t paddr, uintptr_t vaddr, size_t size);
 
 /**
  * Unmap a previously mapped kernel virtual address.
+ * The range is rounded out to whole pages; large pages that are only partly
+ * covered are split first. TLB entries are invalidated in one batch, and page
+ * tables left empty are freed only after that flush.
+ * Mappings set up at boot are permanent and can't be unmapped.
  *
  * @param vptr: Kernel virtual address returned by kmap
  * @param size: Size in bytes
@@ -56,17 +61,25 @@ int kunmap(void *vptr, size_t size);
 /**
  * Temporary mapping of a single page.
  * Often used in low-level kernel code for accessing specific physical memory.
+ * Uses one of the calling CPU's fixmap slots: no allocation and no lock, but
+ * the mapping is only valid on this CPU, and mappings must be undone in
+ * reverse order, at most KMAP_ATOMIC_SLOTS deep.
  *
  * @param paddr: Physical address of page
- * @return kernel virtual address of mapped page
+ * @return kernel virtual address of mapped page (paddr's page offset kept)
  */
-void *kmapAtomic(uintptr_t paddr) __unimplemented("kmapAtomic");
+void *kmapAtomic(uintptr_t paddr);
 
 /**
  * Undo temporary mapping created by kmap_atomic
  *
  * @param vptr: Kernel virtual address returned by kmapAtomic
  */
-void kunmapAtomic(void *vptr) __unimplemented("kunmapAtomic");
+void kunmapAtomic(void *vptr);
+
+/**
+ * Build the page table behind the kmapAtomic() slots. Called once by vmmInit().
+ */
+void kmapAtomicInit();
 
 #endif
\ No newline at end of file
@@ -27,6 +27,7 @@ struct MemoryMapEntry {
 struct MemoryEntries {
     struct MemoryMapEntry *entries;
     size_t count;
+    size_t capacity;    // room in entries, for code that splits an entry
 };
 
 struct MemoryMap {
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <spinlock.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct SlubCache;
+
+enum MempoolKind {
+    MEMPOOL_CACHE,  // objects from a named slab cache
+    MEMPOOL_SIZE,   // objects from the kmalloc() size classes
+    MEMPOOL_PAGES   // page blocks from pageAlloc()
+};
+
+/**
+ * Reserve of pre-allocated elements for paths that must make forward progress.
+ * Allocation goes to the normal allocator first and only dips into the reserve
+ * when that fails; frees top the reserve back up before anything is released.
+ */
+struct Mempool {
+    enum MempoolKind kind;
+    struct SlubCache *cache;    // MEMPOOL_CACHE
+    size_t size;                // bytes for MEMPOOL_SIZE, pages for MEMPOOL_PAGES
+    size_t minReserved;
+    size_t reserved;
+    void **elements;            // reserve stack, minReserved slots
+    struct Spinlock lock;
+};
+
+/**
+ * Create a pool and fill its reserve.
+ *
+ * @param pool: Pool to initialize
+ * @param minReserved: Number of elements kept in reserve
+ * @return true if the reserve could be filled
+ */
+bool mempoolInitCache(struct Mempool *pool, size_t minReserved, struct SlubCache *cache);
+bool mempoolInitSize(struct Mempool *pool, size_t minReserved, size_t size);
+bool mempoolInitPages(struct Mempool *pool, size_t minReserved, size_t pageCount);
+
+/**
+ * Allocate one element.
+ *
+ * @return direct-map virtual address, or NULL if both the allocator and the reserve are empty
+ */
+void *mempoolAlloc(struct Mempool *pool);
+
+/**
+ * Free an element from mempoolAlloc; it refills the reserve first.
+ */
+void mempoolFree(struct Mempool *pool, void *element);
+
+/**
+ * Top the reserve back up from the normal allocator.
+ *
+ * @return true if the reserve is full
+ */
+bool mempoolRefill(struct Mempool *pool);
+
+#endif
\ No newline at end of file
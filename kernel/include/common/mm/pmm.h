@@ -23,5 +23,18 @@ void pmmDumpStats(bool dumpBuddy);
 void *pageAlloc(enum ZoneType type, size_t pageCount); 
 void *pageAllocAligned(enum ZoneType type, size_t pageCount, size_t alignment);
 void pageFree(void *paddr);
+void *pageBlockBase(void *paddr);
+size_t pageBlockPages(void *paddr);
+
+/**
+ * Page reference counts, for frames mapped in more than one place.
+ * A fresh page has one reference; pageGet() adds one, pagePut() drops one and
+ * frees the page (or block, given its first page) with the last.
+ *
+ * @return pagePut(): true if the page was freed
+ */
+void pageGet(void *paddr);
+bool pagePut(void *paddr);
+size_t pageRefCount(void *paddr);
 
 #endif
\ No newline at end of file
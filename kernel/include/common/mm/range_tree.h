@@ -0,0 +1,82 @@
+#pragma once
+#ifndef RANGE_TREE_H
+#define RANGE_TREE_H
+
+#include <macros.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * B+tree of disjoint [start, end) ranges.
+ * Nodes are 256 bytes and cache-line aligned; a leaf holds 10 ranges with the
+ * start keys packed together, an inner node fans out to 15 children, so a
+ * lookup touches a handful of cache lines instead of one node per level.
+ */
+#define RANGE_TREE_NODE_SIZE   256
+#define RANGE_TREE_LEAF_SLOTS  10
+#define RANGE_TREE_INNER_SLOTS 15
+
+// Nodes kept in reserve so an insert on the mapping path can't fail
+#define RANGE_TREE_NODE_RESERVE 16UL
+
+struct RangeTreeNode {
+    uint8_t leaf;
+    uint8_t count;  // ranges in a leaf, children in an inner node
+    union {
+        struct {
+            uintptr_t start[RANGE_TREE_LEAF_SLOTS];
+            uintptr_t end[RANGE_TREE_LEAF_SLOTS];
+            void *value[RANGE_TREE_LEAF_SLOTS];
+        } l;
+        struct {
+            // pivot[i] separates child[i] (below) from child[i + 1] (at or above)
+            uintptr_t pivot[RANGE_TREE_INNER_SLOTS - 1];
+            struct RangeTreeNode *child[RANGE_TREE_INNER_SLOTS];
+        } i;
+    };
+} __alignment(64);
+
+_Static_assert(sizeof(struct RangeTreeNode) == RANGE_TREE_NODE_SIZE,
+               "RangeTreeNode must stay four cache lines");
+
+struct RangeTree {
+    struct RangeTreeNode *root;
+    uint32_t height;    // 0 when empty, 1 for a single leaf
+    size_t count;
+};
+
+/**
+ * Set up the node cache and its reserve. Must run once after slubInit().
+ *
+ * @return false if the cache could not be created
+ */
+bool rangeTreeSetup();
+
+void rangeTreeInit(struct RangeTree *tree);
+
+/**
+ * Insert [start, end) -> value. Ranges must not overlap.
+ *
+ * @return false when out of memory (the tree is unchanged)
+ */
+bool rangeTreeInsert(struct RangeTree *tree, uintptr_t start, uintptr_t end, void *value);
+
+/**
+ * Remove the range that starts exactly at start.
+ *
+ * @return its value, or NULL if there was none
+ */
+void *rangeTreeRemove(struct RangeTree *tree, uintptr_t start);
+
+/**
+ * Value of the range containing addr, NULL if none does.
+ */
+void *rangeTreeLookup(struct RangeTree *tree, uintptr_t addr);
+
+/**
+ * Free every node. Values are left alone.
+ */
+void rangeTreeDestroy(struct RangeTree *tree);
+
+#endif
\ No newline at end of file
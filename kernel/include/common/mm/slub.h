@@ -4,9 +4,108 @@
 
 #include <stddef.h>
 
+struct SlubCache;
+
 void slubInit();
+void slubDumpStats();
+void slubBenchMagazines(size_t iterations);
+
+/**
+ * Allocate size bytes from the size-class caches, or whole pages above 6 KiB.
+ *
+ * @return direct-map virtual address, or NULL when out of memory
+ */
+void *kmalloc(size_t size);
+
+/**
+ * Free memory from kmalloc/krealloc. NULL is ignored.
+ */
+void kfree(void *ptr);
+
+/**
+ * Free memory from kmalloc when the caller knows the size it asked for.
+ * The size selects the size class directly, so no slab lookup is needed;
+ * debug builds still look the slab up and reject a size that doesn't match.
+ *
+ * @param size: The size passed to kmalloc (or anything in the same size class)
+ */
+void kfreeSized(void *ptr, size_t size);
+
+/**
+ * Resize an allocation; the contents up to the smaller size are kept.
+ * krealloc(NULL, n) is kmalloc(n) and krealloc(p, 0) frees p and returns NULL.
+ *
+ * @return the (possibly moved) allocation, or NULL on failure (ptr stays valid)
+ */
+void *krealloc(void *ptr, size_t size);
+
+/**
+ * Usable size of an allocation, at least what was asked for.
+ *
+ * @return size in bytes, 0 if ptr is not an allocation
+ */
+size_t ksize(void *ptr);
+
+/**
+ * kmalloc()/kfree() returning physical addresses, for code that hands memory to hardware.
+ */
 void *slubAlloc(size_t size);
 void slubFree(void *paddr);
-void slubDumpStats();
+void slubFreeSized(void *paddr, size_t size);
+
+/**
+ * Create a dedicated cache for objects of exactly `size` bytes.
+ *
+ * @param name: Cache name, shown in stats (must outlive the cache)
+ * @param size: Object size in bytes
+ * @param align: Object alignment (power of two, 0 = default)
+ * @param ctor: Optional constructor, run once per object when a slab is built
+ * @return the new cache, or NULL on failure
+ */
+struct SlubCache *slubCacheCreate(const char *name, size_t size, size_t align,
+                                  void (*ctor)(void *obj));
+
+/**
+ * Allocate one object from a cache.
+ * Objects come back in the state left by the constructor (or by the last free).
+ *
+ * @return direct-map virtual address of the object, or NULL when out of memory
+ */
+void *slubCacheAlloc(struct SlubCache *cache);
+
+/**
+ * Return an object to the cache it was allocated from.
+ * The cache is trusted, so release builds skip the slab lookup; debug builds
+ * check that the object belongs to it.
+ *
+ * @param obj: Address returned by slubCacheAlloc
+ */
+void slubCacheFree(struct SlubCache *cache, void *obj);
+
+/**
+ * Allocate n objects of the same size in one call.
+ * Objects are taken from one slab's freelist at a time.
+ *
+ * @param size: Object size in bytes
+ * @param n: Number of objects
+ * @param out: Receives n virtual addresses
+ * @return n on success, 0 on failure (nothing is left allocated)
+ */
+size_t slubAllocBulk(size_t size, size_t n, void **out);
+
+/**
+ * Free n objects from kmalloc/slubAllocBulk.
+ * Consecutive objects of the same slab share one slab lookup.
+ *
+ * @param n: Number of objects
+ * @param ptrs: Virtual addresses (NULL entries are skipped)
+ */
+void slubFreeBulk(size_t n, void **ptrs);
+
+/**
+ * slubAllocBulk()/slubFreeBulk() for a named cache.
+ */
+size_t slubCacheAllocBulk(struct SlubCache *cache, size_t n, void **out);
+void slubCacheFreeBulk(struct SlubCache *cache, size_t n, void **ptrs);
 
 #endif
\ No newline at end of file
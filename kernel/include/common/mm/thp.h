@@ -0,0 +1,30 @@
+#pragma once
+#ifndef THP_H
+#define THP_H
+
+#include <stddef.h>
+
+struct AddressSpace;
+
+/**
+ * Transparent huge pages: anonymous memory is faulted in 4 KiB at a time, so
+ * a collapse pass later promotes every 2 MiB-aligned region that has become
+ * fully populated to one 2 MiB page. The 512 pages are copied into a fresh
+ * order-9 block, the page table is replaced by a single large entry, and the
+ * old pages and table are freed.
+ *
+ * Regions are skipped when a page is missing, is shared with another address
+ * space or has a different protection from its neighbours.
+ */
+
+/**
+ * Examine up to maxRegions 2 MiB regions of as, resuming where the previous
+ * call stopped and starting over once the end is reached. Meant to be run
+ * periodically from a background context; it takes as->lock. There is no
+ * such context yet, so nothing in the tree calls it.
+ *
+ * @return number of regions collapsed
+ */
+size_t thpCollapseScan(struct AddressSpace *as, size_t maxRegions);
+
+#endif
\ No newline at end of file
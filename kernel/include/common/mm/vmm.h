@@ -2,7 +2,12 @@
 #ifndef VMM_H
 #define VMM_H
 
+#include <cpu/topology.h>
 #include <macros.h>
+#include <mm/mempool.h>
+#include <mm/range_tree.h>
+#include <spinlock.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -16,9 +21,45 @@ enum VMMMapFlags {
     VM_KMAP             = 1 << 3, // kernel mapped
     VM_PERMANENT        = 1 << 4,
     VM_FIXED            = 1 << 5,
-    VM_FIXED_NOREPLACE  = 1 << 6
+    VM_FIXED_NOREPLACE  = 1 << 6,
+    VM_LAZY             = 1 << 7, // pages are allocated on first touch; paddr is unused
+    VM_USER             = 1 << 8, // reachable from user mode
+    VM_ANON             = 1 << 9, // frames belong to the mapping and are freed with it
+    VM_PRIVATE          = 1 << 10, // frames shared by a clone are copied on first write
+    VM_HUGE_2MB         = 1 << 11, // backed by 2 MiB pages from the huge page pool
+    VM_HUGE_1GB         = 1 << 12  // backed by 1 GiB pages from the huge page pool
 };
 
+#define VM_PROT_MASK (VM_READ | VM_WRITE | VM_EXEC)
+#define VM_HUGE      (VM_HUGE_2MB | VM_HUGE_1GB)
+
+// Size of the pages backing a mapping with these flags
+static inline size_t vmmPageSize(uint32_t flags) {
+    if (flags & VM_HUGE_1GB)
+        return SIZE_1GB;
+    if (flags & VM_HUGE_2MB)
+        return SIZE_2MB;
+    return SIZE_4KB;
+}
+
+// The user half; page 0 stays unmapped so NULL dereferences fault
+#define VMM_USER_START 0x0000000000001000ULL
+#define VMM_USER_END   0x0000800000000000ULL
+
+// Window kmap() allocates virtual addresses from when the caller passes vaddr 0
+#define VMM_KERNEL_DYNAMIC_START 0xFFFFC90000000000ULL
+#define VMM_KERNEL_DYNAMIC_END   0xFFFFE90000000000ULL
+
+// Per-CPU kmapAtomic() slots, right above the dynamic window
+#define VMM_FIXMAP_START    VMM_KERNEL_DYNAMIC_END
+#define KMAP_ATOMIC_SLOTS   8U  // nesting depth per CPU
+
+// PML4 slots from here up map the kernel half, shared by every address space
+#define VMM_KERNEL_PML4_START 256
+
+// VMMNodes kept in reserve so mapping can make progress when the slab is out of memory
+#define VMM_NODE_RESERVE 32UL
+
 /**
  * Classic Red-Black Tree Colors
  */
@@ -28,12 +69,19 @@ enum VMMRBColor {
     VMM_RB_NIL
 };
 
+struct SlubCache;
+
 struct VMMNode {
     uintptr_t vaddr;    // virtual address base
     uintptr_t paddr;    // physical address base
     size_t size;        // length in bytes
     uint32_t flags;     // read/write/exec/kernel/etc
 
+    // Augmentation, recomputed from the children whenever the subtree changes
+    uintptr_t subtreeMinStart; // lowest vaddr in this subtree
+    uintptr_t subtreeMaxEnd;   // highest vaddr + size in this subtree
+    size_t subtreeMaxGap;      // largest hole between two mappings of this subtree
+
     enum VMMRBColor color;
     struct VMMNode *parent;
     struct VMMNode *left;
@@ -42,16 +90,239 @@ struct VMMNode {
 
 struct VMMTree {
     struct VMMNode *root;
+    struct VMMNode nil;         // sentinel, owned by this tree
 };
 
-extern struct VMMTree vmmTree;
-extern struct VMMNode vmmNilNode;
+// PCID an address space holds on one CPU; stale once that CPU's generation moves on
+struct TLBContext {
+    volatile uint64_t generation;   // 0: none
+    uint16_t pcid;
+};
+
+/**
+ * One virtual address space: its page tables and the mappings in them.
+ * The kernel half of every PML4 is a copy of kernelAddressSpace's, kept in
+ * sync as new kernel PML4 entries appear. Tree and index functions expect the
+ * caller to hold lock.
+ */
+struct AddressSpace {
+    uint64_t *pml4;             // top-level table (HHDM virtual)
+    struct VMMTree tree;
+    struct RangeTree index;     // vaddr -> VMMNode, answers vmmFindNodeContaining()
+    bool indexValid;            // cleared if the index ever misses an insert
+    struct Spinlock lock;
+    volatile uint64_t seq;      // new value from a global counter on every tree change
+    uintptr_t collapseCursor;   // where thpCollapseScan() resumes
+    volatile uint64_t cpuMask;  // bit cpuGetID() of every CPU it is loaded on
+    struct TLBContext tlb[CPU_MAX];
+    struct AddressSpace *next;  // all address spaces
+};
+
+extern struct AddressSpace kernelAddressSpace;
+extern struct SlubCache *vmmNodeCache;
+extern struct Mempool vmmNodePool;
+
+/**
+ * Create an empty address space sharing the kernel half.
+ *
+ * @return the new address space, or NULL when out of memory
+ */
+struct AddressSpace *addressSpaceCreate();
+
+/**
+ * Free an address space's user-half page tables, its nodes (which must come
+ * from vmmNodePool) and the address space itself. VM_ANON frames lose their
+ * reference, other frames are left to whoever mapped them. No CPU may still
+ * be running on it.
+ */
+void addressSpaceDestroy(struct AddressSpace *as);
+
+/**
+ * Load as into CR3 on this CPU.
+ */
+void addressSpaceSwitch(struct AddressSpace *as);
+
+/**
+ * Duplicate src's user half into a new address space. Page tables are copied
+ * but frames are not: VM_PRIVATE pages become read-only on both sides and are
+ * copied on the first write, other anonymous pages stay shared.
+ *
+ * @return the clone, or NULL when out of memory
+ */
+struct AddressSpace *addressSpaceClone(struct AddressSpace *src);
+
+/**
+ * Address space this CPU is running on.
+ */
+struct AddressSpace *addressSpaceCurrent();
+
+/**
+ * Copy kernel PML4 slot index into every address space; called after
+ * kernelAddressSpace.pml4[index] changes.
+ */
+void addressSpaceSyncKernel(size_t index);
+
+void vmmInitRBTree(struct AddressSpace *as);
+struct VMMNode *vmmFindNodeContaining(struct AddressSpace *as, uintptr_t vaddr);
+
+/**
+ * Find the lowest mapping that overlaps [start, start + size).
+ *
+ * @return the node, or NULL if the range is free
+ */
+struct VMMNode *vmmFindNodeOverlapping(struct AddressSpace *as, uintptr_t start, size_t size);
+
+/**
+ * Call fn on every mapping that overlaps [start, start + size), in address
+ * order, in O(log n + k). fn returns false to stop early. fn must not insert
+ * or delete nodes; collect them and change the tree after the walk, or walk
+ * with vmmFindNodeOverlapping()/vmmNextNode() instead.
+ */
+void vmmVisitOverlapping(struct AddressSpace *as, uintptr_t start, size_t size,
+                         bool (*fn)(struct VMMNode *node, void *ctx), void *ctx);
+
+/**
+ * In-order successor of node, NULL for the last mapping.
+ */
+struct VMMNode *vmmNextNode(struct AddressSpace *as, struct VMMNode *node);
+
+/**
+ * Time vmmFindNodeContaining() through the RB tree, the range index and the
+ * per-CPU lookup cache over `mappings` temporary kernel nodes placed at the
+ * top of the dynamic window.
+ */
+void vmmBenchLookup(size_t mappings, size_t lookups);
 
-__init void vmmInitRBTree();
-struct VMMNode *vmmFindNodeContaining(uintptr_t vaddr);
-struct VMMNode *vmmFindNodeOverlapping(uintptr_t start, size_t size);
-void vmmInsert(struct VMMNode *node);
-void vmmDelete(struct VMMNode *node);
+void vmmInsert(struct AddressSpace *as, struct VMMNode *node);
+void vmmDelete(struct AddressSpace *as, struct VMMNode *node);
+
+/**
+ * Insert node, folding it into a neighbour that ends where it starts (or
+ * starts where it ends) with the same flags and a contiguous physical range.
+ * node must come from vmmNodePool; if it was merged it is freed.
+ *
+ * @return the node that now covers node's range
+ */
+struct VMMNode *vmmInsertMerge(struct AddressSpace *as, struct VMMNode *node);
+
+/**
+ * Cut node in two at address at; node keeps [vaddr, at).
+ *
+ * @return the new node covering [at, end), or NULL if at is not inside node
+ *         or no node could be allocated
+ */
+struct VMMNode *vmmSplitNode(struct AddressSpace *as, struct VMMNode *node, uintptr_t at);
+
+/**
+ * Reserve a lazily-backed range: no page is allocated until it is touched.
+ *
+ * @param vaddr: Start of the range, or 0 to pick one (the dynamic window for
+ *               kernelAddressSpace)
+ * @param flags: VM_READ/VM_WRITE/VM_EXEC/VM_USER; VM_LAZY and VM_ANON are implied
+ * @return start of the range, or NULL if it is taken or memory ran out
+ */
+void *vmmReserve(struct AddressSpace *as, uintptr_t vaddr, size_t size, uint32_t flags);
+
+/**
+ * Map one page (level 0 = 4 KiB, 1 = 2 MiB, 2 = 1 GiB) with the protection
+ * given by VM_WRITE/VM_EXEC/VM_USER in vmFlags. Caller holds as->lock.
+ */
+bool vmmMapPage(struct AddressSpace *as, uintptr_t vaddr, uintptr_t paddr, int level,
+                uint32_t vmFlags);
+
+/**
+ * Entry at level (0 = PT ... 3 = PML4) on vaddr's walk.
+ *
+ * @return the entry, or NULL if a level above isn't a page table
+ */
+uint64_t *vmmEntryAt(struct AddressSpace *as, uintptr_t vaddr, int level);
+
+/**
+ * Leaf page table entry translating vaddr.
+ *
+ * @param level: Receives the entry's level (0 = 4 KiB, 1 = 2 MiB, 2 = 1 GiB); may be NULL
+ * @return the entry, or NULL if vaddr is not mapped
+ */
+uint64_t *vmmWalk(struct AddressSpace *as, uintptr_t vaddr, int *level);
+
+/**
+ * Make at a page boundary in as's page tables: a large page straddling it is
+ * split into a table of smaller ones (a 2 MiB anonymous page into private
+ * 4 KiB copies). Call before cutting a mapping at at, so the cut can't fail
+ * halfway. Caller holds as->lock.
+ *
+ * @param vmFlags: Flags of the mapping containing at
+ * @return false when out of memory or the page can't be split (huge pool
+ *         pages); nothing changed then
+ */
+bool vmmBreakLargePages(struct AddressSpace *as, uintptr_t at, uint32_t vmFlags);
+
+/**
+ * Clear the page table entries of [start, start + size) and free page tables
+ * left empty. A 2 MiB anonymous page covered in part is first split into
+ * 4 KiB copies, other large pages into smaller ones; break them up front with
+ * vmmBreakLargePages() where failing halfway isn't acceptable. Caller holds as->lock.
+ *
+ * @param vmFlags: Flags of the mapping; VM_ANON frames lose a reference
+ */
+void vmmUnmapPages(struct AddressSpace *as, uintptr_t start, size_t size, uint32_t vmFlags);
+
+/**
+ * Rewrite the protection of the pages mapped in [start, start + size) to match
+ * vmFlags, keeping their frames. Copy-on-write pages still shared stay
+ * read-only. Caller holds as->lock.
+ */
+void vmmProtectPages(struct AddressSpace *as, uintptr_t start, size_t size, uint32_t vmFlags);
+
+/**
+ * Map src's pages in [start, start + size) at the same addresses in dst.
+ * VM_ANON frames gain a reference; VM_PRIVATE ones are write-protected in
+ * both. src's TLB is not flushed. Caller holds src->lock.
+ *
+ * @return false if a page table couldn't be allocated
+ */
+bool vmmCopyPages(struct AddressSpace *dst, struct AddressSpace *src, uintptr_t start,
+                  size_t size, uint32_t vmFlags);
+
+/**
+ * Reference counting for the frames of a VM_ANON mapping with these flags:
+ * the huge page pool for VM_HUGE mappings, the page allocator otherwise.
+ *
+ * @return vmmFramePut(): true if the frame was released
+ */
+void vmmFrameGet(void *frame, uint32_t vmFlags);
+bool vmmFramePut(void *frame, uint32_t vmFlags);
+size_t vmmFrameRefCount(void *frame, uint32_t vmFlags);
+
+/**
+ * Drop vaddr's translation from this CPU's TLB if as is loaded here.
+ */
+void vmmFlushPage(struct AddressSpace *as, uintptr_t vaddr);
+
+/**
+ * Drop every non-global translation of as from this CPU's TLB if as is
+ * loaded here.
+ */
+void vmmFlushAll(struct AddressSpace *as);
+
+/**
+ * Change a node's range in place. The new range must not overlap other nodes.
+ */
+void vmmResizeNode(struct AddressSpace *as, struct VMMNode *node, uintptr_t vaddr,
+                   uintptr_t paddr, size_t size);
+
+/**
+ * Find the lowest free virtual range of size bytes inside [lo, hi).
+ * Subtrees whose largest hole is too small are skipped, so this is O(log n).
+ *
+ * @param size: Length in bytes
+ * @param align: Alignment of the returned address (power of two)
+ * @param lo: Lowest acceptable address
+ * @param hi: End of the window (exclusive)
+ * @return start of the free range, or 0 if none fits
+ */
+uintptr_t vmmFindFreeRange(struct AddressSpace *as, size_t size, size_t align,
+                           uintptr_t lo, uintptr_t hi);
 
 __init void vmmInit();
 uint16_t getPageCountFromRange(uintptr_t start, uintptr_t end);
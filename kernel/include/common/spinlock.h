@@ -0,0 +1,40 @@
+#pragma once
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdbool.h>
+
+/**
+ * Minimal test-and-test-and-set spinlock.
+ * Doesn't touch the interrupt flag; don't take one from an interrupt handler
+ * if it can also be held by the code that was interrupted.
+ */
+struct Spinlock {
+    volatile int locked;
+};
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spinInit(struct Spinlock *lock) {
+    lock->locked = 0;
+}
+
+static inline bool spinTryLock(struct Spinlock *lock) {
+    return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spinLock(struct Spinlock *lock) {
+    while (!spinTryLock(lock)) {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+#if defined(__x86_64__) || defined(__i386__)
+            __asm__ volatile ("pause");
+#endif
+        }
+    }
+}
+
+static inline void spinUnlock(struct Spinlock *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif
\ No newline at end of file
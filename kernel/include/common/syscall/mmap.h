@@ -29,8 +29,38 @@ enum MemoryMappingFlags {
     MAP_SYNC            = 1 << 13
 };
 
+#define MAP_FAILED ((void *)-1)
+
+/**
+ * Map anonymous memory into the current address space's user half.
+ * Pages are zero-filled on first touch unless MAP_POPULATE asks for them now.
+ * MAP_HUGE_2MB/MAP_HUGE_1GB map pages from the boot-time huge page pool with
+ * large entries, all at once; length and MAP_FIXED addresses are then in
+ * units of that page size, and munmap/mprotect can't split a page.
+ *
+ * @param addr: Placement hint, or the exact address with MAP_FIXED (replacing
+ *              what was there) or MAP_FIXED_NOREPLACE (failing instead)
+ * @param flags: MAP_ANONYMOUS plus MAP_SHARED or MAP_PRIVATE (copied on write
+ *               once the address space is cloned); file mappings are not
+ *               supported, fd and offset are ignored
+ * @return start of the mapping, or MAP_FAILED
+ */
 void *mmap(void *addr, size_t length,  int prot, int flags, int fd, uintptr_t offset);
+
+/**
+ * Unmap every page in [addr, addr + length), freeing anonymous frames and
+ * emptied page tables. Holes in the range are fine.
+ *
+ * @return 0, or -1 if the range is invalid or holds a permanent mapping
+ */
 int munmap(void *addr, size_t length);
+
+/**
+ * Change the protection of [addr, addr + length), which must be fully mapped.
+ * Page table entries are rewritten in place.
+ *
+ * @return 0, or -1 if the range is invalid or not fully mapped
+ */
 int mprotect(void *addr, size_t length, int prot);
 
 #endif
\ No newline at end of file
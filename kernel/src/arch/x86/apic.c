@@ -0,0 +1,92 @@
+#include <cpu/topology.h>
+#include <mm/kmap.h>
+#include <panic.h>
+#include <printf.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <x86/apic.h>
+#include <x86/cpuid.h>
+#include <x86/msr.h>
+
+enum LAPICRegister {
+  LAPIC_ID = 0x020,
+  LAPIC_EOI = 0x0B0,
+  LAPIC_SVR = 0x0F0,
+  LAPIC_ICR_LOW = 0x300,
+  LAPIC_ICR_HIGH = 0x310,
+};
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_ICR_PENDING (1 << 12)
+#define LAPIC_ICR_ASSERT (1 << 14)
+#define APIC_BASE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+#define CPUID_1_ECX_X2APIC (1 << 21)
+
+static bool x2apic = false;
+static volatile uint32_t *lapicMMIO = NULL; // xAPIC registers, kmapped
+static uint32_t apicIDs[CPU_MAX];           // cpuGetID() -> APIC ID
+
+static inline uint32_t lapicRead(uint32_t reg) {
+  if (x2apic)
+    return (uint32_t)rdmsr(MSR_X2APIC_BASE + reg / 16);
+  return lapicMMIO[reg / 4];
+}
+
+static inline void lapicWrite(uint32_t reg, uint32_t value) {
+  if (x2apic)
+    wrmsr(MSR_X2APIC_BASE + reg / 16, value);
+  else
+    lapicMMIO[reg / 4] = value;
+}
+
+void lapicInit() {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+  uint64_t base = rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+  if (ecx & CPUID_1_ECX_X2APIC) {
+    x2apic = true;
+    base |= APIC_BASE_X2APIC;
+  } else if (!lapicMMIO) {
+    // the MTRRs keep this range uncached whatever the PTE says
+    lapicMMIO = kmap(base & APIC_BASE_ADDR_MASK, 0, 4096);
+    if (!lapicMMIO)
+      panic("Failed to map the local APIC\n");
+  }
+  wrmsr(MSR_APIC_BASE, base);
+
+  lapicWrite(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS);
+
+  uint32_t cpu = cpuGetID();
+  apicIDs[cpu] = lapicID();
+  __atomic_fetch_or(&cpuOnlineMask, 1ULL << cpu, __ATOMIC_SEQ_CST);
+
+#ifndef NDEBUG
+  printfDebug("CPU %u: local APIC %u (%s)\n", cpu, apicIDs[cpu],
+              x2apic ? "x2APIC" : "xAPIC");
+#endif
+}
+
+uint32_t lapicID() {
+  if (x2apic)
+    return lapicRead(LAPIC_ID);
+  return lapicRead(LAPIC_ID) >> 24;
+}
+
+void lapicSendIPI(uint32_t cpu, uint8_t vector) {
+  if (x2apic) {
+    // one 64-bit write, no delivery status to wait for
+    wrmsr(MSR_X2APIC_BASE + LAPIC_ICR_LOW / 16,
+          ((uint64_t)apicIDs[cpu] << 32) | LAPIC_ICR_ASSERT | vector);
+    return;
+  }
+
+  while (lapicRead(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+    __asm__ volatile("pause");
+  lapicWrite(LAPIC_ICR_HIGH, apicIDs[cpu] << 24);
+  lapicWrite(LAPIC_ICR_LOW, LAPIC_ICR_ASSERT | vector);
+}
+
+void lapicEOI() { lapicWrite(LAPIC_EOI, 0); }
\ No newline at end of file
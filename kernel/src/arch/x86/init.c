@@ -1,8 +1,21 @@
 #include <arch-hook.h>
 #include <serial.h>
+#include <x86/apic.h>
 #include <x86/idt.h>
+#include <x86/tlb.h>
 
 void archEarlyInit() {
     initIDT();
     serialInitPort(COM1_BASE_PORT, 9600);
+}
+
+void archPostInit() {
+    lapicInit();
+    tlbInit();
+}
+
+uint64_t archCycleCounter() {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
 }
\ No newline at end of file
@@ -16,6 +16,11 @@ void registerInterruptHandler(uint8_t interrupt, void (*handler)(struct Interrup
 }
 
 void exceptionHandler(struct InterruptFrame *frame) {
+	if (frame->intNo == PAGE_FAULT) {
+		pageFaultHandler(frame);
+		return;
+	}
+
 	static int isDead = 0;
 	uint64_t cr2, rsp;
 	__asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
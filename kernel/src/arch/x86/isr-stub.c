@@ -93,6 +93,7 @@ ISR_NOERR_STUB(31)
 __naked_section(".irq")         \
 void irqStub##n(void) {         \
     __asm__ volatile (          \
+        "push $0\n"             \
         "push $" #n "\n"        \
         "jmp irqCommonStub\n"   \
     );                          \
@@ -0,0 +1,173 @@
+#include <mm/fault.h>
+#include <mm/hhdm.h>
+#include <mm/hugepage.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/zone.h>
+#include <panic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdmem.h>
+#include <x86/idt.h>
+#include <x86/page_table.h>
+#include <x86/tlb.h>
+
+extern size_t pagePhysicalMask;
+
+// Page fault error code pushed by the CPU
+enum PageFaultError {
+  PF_PRESENT = 1 << 0, // protection violation on a present page
+  PF_WRITE = 1 << 1,
+  PF_USER = 1 << 2,
+  PF_RESERVED = 1 << 3, // a reserved bit was set in a paging entry
+  PF_FETCH = 1 << 4     // instruction fetch
+};
+
+const char *faultResultName(enum FaultResult result) {
+  switch (result) {
+  case FAULT_HANDLED:
+    return "handled";
+  case FAULT_NOT_MAPPED:
+    return "not mapped";
+  case FAULT_ACCESS:
+    return "access violation";
+  case FAULT_NO_MEMORY:
+    return "out of memory";
+  }
+  return "unknown";
+}
+
+// The entry already permits the access, e.g. another CPU raised it first and
+// this one faulted on a stale TLB entry
+static bool pteAllows(uint64_t pte, uint32_t flags) {
+  if ((flags & FAULT_WRITE) && !(pte & PTE64_RW))
+    return false;
+  if ((flags & FAULT_USER) && !(pte & PTE64_US))
+    return false;
+  if ((flags & FAULT_EXEC) && (pte & PTE64_NX))
+    return false;
+  return true;
+}
+
+// Write to a read-only page of a VM_PRIVATE mapping: give this address space
+// its own copy, or just the write bit back if nobody shares the frame anymore
+static enum FaultResult breakCow(struct AddressSpace *as, struct VMMNode *node,
+                                 uintptr_t addr, uint64_t *pte, int level) {
+  bool huge = node->flags & VM_HUGE;
+  if (level > (huge ? 2 : 1))
+    return FAULT_ACCESS;
+
+  size_t size = level == 2 ? SIZE_1GB : level == 1 ? SIZE_2MB : PAGE_SIZE;
+  uintptr_t page = __aligndown(addr, size);
+  void *frame = (void *)(*pte & pagePhysicalMask);
+  if (vmmFrameRefCount(frame, node->flags) == 1) {
+    *pte |= PTE64_RW;
+    vmmFlushPage(as, page);
+    return FAULT_HANDLED;
+  }
+
+  // huge mappings copy into the pool they were promised
+  void *copy = huge ? hugePageAlloc(size)
+                    : pageAllocAligned(ZONE_NORMAL, size / PAGE_SIZE, size);
+  if (!copy)
+    return FAULT_NO_MEMORY;
+  memcpy(hhdmAdd(copy), hhdmAdd(frame), size);
+
+  // the page tables already exist, so this only rewrites the entry
+  if (!vmmMapPage(as, page, (uintptr_t)copy, level, node->flags)) {
+    vmmFramePut(copy, node->flags);
+    return FAULT_NO_MEMORY;
+  }
+  vmmFlushPage(as, page);
+  vmmFramePut(frame, node->flags);
+  return FAULT_HANDLED;
+}
+
+static enum FaultResult handleFaultLocked(struct AddressSpace *as,
+                                          uintptr_t addr, uint32_t flags) {
+  struct VMMNode *node = vmmFindNodeContaining(as, addr);
+  if (!node)
+    return FAULT_NOT_MAPPED;
+
+  if (!(node->flags & VM_PROT_MASK))
+    return FAULT_ACCESS;
+  if ((flags & FAULT_WRITE) && !(node->flags & VM_WRITE))
+    return FAULT_ACCESS;
+  if ((flags & FAULT_EXEC) && !(node->flags & VM_EXEC))
+    return FAULT_ACCESS;
+  if ((flags & FAULT_USER) && !(node->flags & VM_USER))
+    return FAULT_ACCESS;
+
+  uintptr_t page = __aligndown(addr, PAGE_SIZE);
+  int level;
+  uint64_t *pte = vmmWalk(as, page, &level);
+  if (pte) {
+    if (pteAllows(*pte, flags))
+      return FAULT_HANDLED;
+    if ((flags & FAULT_WRITE) && (node->flags & VM_PRIVATE) &&
+        pteAllows(*pte, flags & ~FAULT_WRITE))
+      return breakCow(as, node, page, pte, level);
+    return FAULT_ACCESS;
+  }
+
+  if (flags & FAULT_PRESENT)
+    return FAULT_ACCESS;
+  if (!(node->flags & VM_LAZY))
+    return FAULT_NOT_MAPPED;
+
+  void *paddr = pageAlloc(ZONE_NORMAL, 1);
+  if (!paddr)
+    return FAULT_NO_MEMORY;
+  memset(hhdmAdd(paddr), 0, PAGE_SIZE);
+
+  if (!vmmMapPage(as, page, (uintptr_t)paddr, 0, node->flags)) {
+    pageFree(paddr);
+    return FAULT_NO_MEMORY;
+  }
+  return FAULT_HANDLED;
+}
+
+enum FaultResult vmmHandleFault(struct AddressSpace *as, uintptr_t addr,
+                                uint32_t flags) {
+  if (addr >= VMM_USER_END) {
+    if (flags & FAULT_USER)
+      return FAULT_ACCESS;
+    as = &kernelAddressSpace;
+  }
+  if (!as)
+    return FAULT_NOT_MAPPED;
+
+  // #PF runs with interrupts off, and the holder may be waiting on this CPU
+  // to acknowledge a shootdown
+  tlbSpinLock(&as->lock);
+  enum FaultResult result = handleFaultLocked(as, addr, flags);
+  spinUnlock(&as->lock);
+  return result;
+}
+
+void pageFaultHandler(struct InterruptFrame *frame) {
+  uintptr_t addr;
+  asm volatile("mov %%cr2, %0" : "=r"(addr));
+
+  uint64_t error = frame->errCode;
+  if (error & PF_RESERVED)
+    panic("page fault: reserved bit set in the entry for 0x%lx (rip 0x%lx)\n",
+          addr, frame->rip);
+
+  uint32_t flags = 0;
+  if (error & PF_PRESENT)
+    flags |= FAULT_PRESENT;
+  if (error & PF_WRITE)
+    flags |= FAULT_WRITE;
+  if (error & PF_USER)
+    flags |= FAULT_USER;
+  if (error & PF_FETCH)
+    flags |= FAULT_EXEC;
+
+  enum FaultResult result = vmmHandleFault(addressSpaceCurrent(), addr, flags);
+  if (result == FAULT_HANDLED)
+    return;
+
+  panic("page fault at 0x%lx (rip 0x%lx, error 0x%lx): %s\n", addr, frame->rip,
+        error, faultResultName(result));
+}
\ No newline at end of file
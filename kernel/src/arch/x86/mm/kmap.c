@@ -1,6 +1,7 @@
 #include <basic_io.h>
 #include <macros.h>
 #include <mm/hhdm.h>
+#include <mm/hugepage.h>
 #include <mm/kmap.h>
 #include <mm/pmm.h>
 #include <mm/slub.h>
@@ -12,20 +13,23 @@
 #include <stdint.h>
 #include <stdmem.h>
 #include <x86/page_table.h>
+#include <x86/tlb.h>
 
 extern size_t pagePhysicalMask;
 extern size_t pagePhysicalBits;
 extern size_t pageVirtualBits;
+extern bool vmmNxEnabled;
 
 #define __allocpage() pageAlloc(ZONE_NORMAL, 1);
 
 #ifdef ARCH_64
-extern uint64_t *root;
 #define PTE_P (1ULL << 0)
 #define PTE_RW (1ULL << 1)
 #define PTE_US (1ULL << 2)  // optional
+#define PTE_G PTE64_GLOBAL  // kernel half only, survives CR3 loads
 #define PTE_PS (1ULL << 7)  // for large pages (not used here)
 #define PTE_NX (1ULL << 63) // if NXE enabled
+#define PTE_NONE (1ULL << 9) // PROT_NONE page: P is clear but the frame is kept
 
 #else
 #error "Only x86_64 supported in early VMM"
@@ -33,7 +37,10 @@ extern uint64_t *root;
 
 #define ENTRY_ADDR_MASK 0x000FFFFFFFFFF000ULL
 
-static bool mapSinglePage(uintptr_t paddr, uintptr_t vaddr, int targetLevel);
+static bool mapSinglePage(uint64_t *pml4, uintptr_t paddr, uintptr_t vaddr,
+                          int targetLevel, uint64_t pteFlags);
+static uintptr_t *walkCreate(uint64_t *pml4, uintptr_t vaddr,
+                             int targetLevel);
 static bool getExistingEntry(uintptr_t *table, uintptr_t *output,
                              uintptr_t vaddr, int targetLevel);
 static uintptr_t *makeNewEntry(uintptr_t *table, uintptr_t paddr,
@@ -54,18 +61,50 @@ static inline int getIndex(uintptr_t vaddr, int level) {
 }
 
 void *kmap(uintptr_t paddr, uintptr_t vaddr, size_t size) {
+  struct AddressSpace *as = &kernelAddressSpace;
   uintptr_t offset = 0;
   size_t remaining = size;
 
+  spinLock(&as->lock);
+
+  // No address given: take a hole in the dynamic window, aligned so the
+  // mapping can still use large pages
+  if (vaddr == 0) {
+    size_t align = SIZE_4KB;
+    if (size >= SIZE_1GB && (paddr & (SIZE_1GB - 1)) == 0)
+      align = SIZE_1GB;
+    else if (size >= SIZE_2MB && (paddr & (SIZE_2MB - 1)) == 0)
+      align = SIZE_2MB;
+
+    vaddr = vmmFindFreeRange(as, size, align, VMM_KERNEL_DYNAMIC_START,
+                             VMM_KERNEL_DYNAMIC_END);
+    if (!vaddr) {
+      spinUnlock(&as->lock);
+      printfError("No kernel virtual space left to map 0x%lx bytes\n", size);
+      return NULL;
+    }
+  }
+
   printfDebug("@@ Mapping paddr 0x%lx until 0x%lx -> vaddr 0x%lx until 0x%lx\n",
               paddr, paddr + size, vaddr, vaddr + size);
 
-  struct VMMNode *conflict = vmmFindNodeOverlapping(vaddr, size);
+  struct VMMNode *conflict = vmmFindNodeOverlapping(as, vaddr, size);
   if (conflict) {
+    spinUnlock(&as->lock);
     printfError("conflict when trying to map 0x%lx to 0x%lx\n", paddr, vaddr);
     return NULL;
   }
 
+  // Take the node before touching page tables, so running out of nodes
+  // leaves them untouched
+  struct VMMNode *node = mempoolAlloc(&vmmNodePool);
+  if (!node) {
+    spinUnlock(&as->lock);
+    printfError("Out of memory when trying to map 0x%lx to 0x%lx\n", paddr,
+                vaddr);
+    return NULL;
+  }
+
   while (remaining > 0) {
     uintptr_t currentPhys = paddr + offset;
     uintptr_t currentVirt = vaddr + offset;
@@ -83,8 +122,14 @@ void *kmap(uintptr_t paddr, uintptr_t vaddr, size_t size) {
       targetLevel = 1; // PDT level = 2MB page
     }
 
-    if (!mapSinglePage(currentPhys, currentVirt, targetLevel))
+    if (!mapSinglePage(as->pml4, currentPhys, currentVirt, targetLevel,
+                       PTE_P | PTE_RW)) {
+      // no node covers what was mapped so far; don't leave it behind
+      vmmUnmapPages(as, vaddr, offset, 0);
+      spinUnlock(&as->lock);
+      mempoolFree(&vmmNodePool, node);
       return NULL;
+    }
 
     size_t mapped = (targetLevel == 2)   ? SIZE_1GB
                     : (targetLevel == 1) ? SIZE_2MB
@@ -94,61 +139,495 @@ void *kmap(uintptr_t paddr, uintptr_t vaddr, size_t size) {
     remaining -= mapped;
   }
 
-  struct VMMNode *nodePhys = slubAlloc(sizeof(struct VMMNode));
-  if (!nodePhys) {
-    panic("Out of memory when trying to map  0x%lx to 0x%lx\n", paddr, vaddr);
-  }
-
-  struct VMMNode *node = hhdmAdd(nodePhys);
   node->vaddr = vaddr;
   node->paddr = paddr;
   node->size = size;
-  node->flags = VM_FIXED_NOREPLACE | VM_KMAP | VM_PERMANENT | VM_EXEC |
-                VM_WRITE | VM_READ;
-  vmmInsert(node);
+  node->flags =
+      VM_FIXED_NOREPLACE | VM_KMAP | VM_EXEC | VM_WRITE | VM_READ;
+  vmmInsertMerge(as, node);
+  spinUnlock(&as->lock);
 
   return (void *)vaddr;
 }
 
-static bool mapSinglePage(uintptr_t paddr, uintptr_t vaddr, int targetLevel) {
-  // root is a virtual pointer to PML4
-  uintptr_t *vtable = (uintptr_t *)root;
+static uint64_t vmFlagsToPte(uint32_t vmFlags) {
+  // x86 can't express a present page nobody may touch
+  if (!(vmFlags & (VM_READ | VM_WRITE | VM_EXEC)))
+    return PTE_NONE;
+
+  uint64_t pte = PTE_P;
+  if (vmFlags & VM_WRITE)
+    pte |= PTE_RW;
+  if (vmFlags & VM_USER)
+    pte |= PTE_US;
+  if (!(vmFlags & VM_EXEC) && vmmNxEnabled)
+    pte |= PTE_NX;
+  return pte;
+}
 
-  // Iterate from PML4 (level 3) down to targetLevel+1 to ensure all
-  // intermediate tables exist
-  for (int lvl = 3; lvl > targetLevel; --lvl) {
-    uintptr_t childPhys = 0;
-    if (getExistingEntry(vtable, &childPhys, vaddr, lvl)) {
-      // Child table exists → descend into it; childPhys holds physical addr
-      vtable = (uintptr_t *)hhdmAdd((void *)childPhys);
+bool vmmMapPage(struct AddressSpace *as, uintptr_t vaddr, uintptr_t paddr,
+                int level, uint32_t vmFlags) {
+  return mapSinglePage(as->pml4, paddr, vaddr, level, vmFlagsToPte(vmFlags));
+}
+
+uint64_t *vmmEntryAt(struct AddressSpace *as, uintptr_t vaddr, int level) {
+  uint64_t *table = as->pml4;
+
+  for (int lvl = 3; lvl > level; --lvl) {
+    uint64_t entry = table[getIndex(vaddr, lvl)];
+    if (!(entry & PTE_P) || (entry & PTE_PS))
+      return NULL;
+    table = (uint64_t *)hhdmAdd((void *)(entry & ENTRY_ADDR_MASK));
+  }
+  return &table[getIndex(vaddr, level)];
+}
+
+uint64_t *vmmWalk(struct AddressSpace *as, uintptr_t vaddr, int *level) {
+  uint64_t *table = as->pml4;
+
+  for (int lvl = 3; lvl >= 0; --lvl) {
+    uint64_t *entry = &table[getIndex(vaddr, lvl)];
+    if (!(*entry & PTE_P))
+      return NULL;
+
+    if (lvl == 0 || (lvl <= 2 && (*entry & PTE_PS))) {
+      if (level)
+        *level = lvl;
+      return entry;
+    }
+    table = (uint64_t *)hhdmAdd((void *)(*entry & ENTRY_ADDR_MASK));
+  }
+  return NULL;
+}
+
+static inline bool pteMapped(uint64_t entry) {
+  return entry & (PTE_P | PTE_NONE);
+}
+
+enum RangeOp {
+  RANGE_UNMAP,   // clear the entries, dropping anonymous frames
+  RANGE_PROTECT, // rewrite the protection bits
+  RANGE_COPY     // duplicate the entries into another address space
+};
+
+struct RangeUpdate {
+  enum RangeOp op;
+  uint32_t vmFlags;          // flags of the node owning the range
+  uint64_t pte;              // RANGE_PROTECT: protection bits to set
+  struct AddressSpace *dst;  // RANGE_COPY: where the entries go
+  struct TLBBatch *batch;    // RANGE_UNMAP/RANGE_PROTECT: collects the flush
+  bool failed;               // RANGE_COPY: a page table couldn't be allocated
+};
+
+static bool tableEmpty(uint64_t *table) {
+  for (int i = 0; i < 512; ++i) {
+    if (table[i])
+      return false;
+  }
+  return true;
+}
+
+void vmmFrameGet(void *frame, uint32_t vmFlags) {
+  if (vmFlags & VM_HUGE)
+    hugePageGet(frame);
+  else
+    pageGet(frame);
+}
+
+bool vmmFramePut(void *frame, uint32_t vmFlags) {
+  if (vmFlags & VM_HUGE)
+    return hugePagePut(frame);
+  return pagePut(frame);
+}
+
+size_t vmmFrameRefCount(void *frame, uint32_t vmFlags) {
+  if (vmFlags & VM_HUGE)
+    return hugePageRefCount(frame);
+  return pageRefCount(frame);
+}
+
+// Replace a large page by a table of the next size down mapping the same
+// frames, so part of it can be unmapped or reprotected
+static bool splitLargePage(uint64_t *entry, uintptr_t base, int level,
+                           struct TLBBatch *batch) {
+  size_t span = 1ULL << (12 + 9 * level);
+  size_t childSpan = span >> 9;
+  uintptr_t frame = *entry & ENTRY_ADDR_MASK & ~(span - 1);
+
+  uintptr_t tablePhys = (uintptr_t)__allocpage();
+  if (!tablePhys)
+    return false;
+  uint64_t *table = (uint64_t *)hhdmAdd((void *)tablePhys);
+
+  // at level 0 bit 7 means PAT, not PS
+  uint64_t flags = *entry & ~ENTRY_ADDR_MASK;
+  if (level == 1)
+    flags &= ~PTE_PS;
+  for (size_t i = 0; i < 512; ++i)
+    table[i] = (frame + i * childSpan) | flags;
+
+  *entry = tablePhys | PTE_P | PTE_RW | (base < VMM_USER_END ? PTE_US : 0);
+  tlbBatchAdd(batch, base);
+  return true;
+}
+
+// Replace a 2 MiB anonymous page with a table of private 4 KiB copies, so
+// part of it can be unmapped or reprotected on its own. A frame still shared
+// copy-on-write just loses this address space's reference
+static bool demoteLargePage(uint64_t *entry, uintptr_t base, int level,
+                            uint32_t vmFlags, struct TLBBatch *batch) {
+  void *frame = (void *)(*entry & ENTRY_ADDR_MASK);
+  if (level != 1 || (vmFlags & VM_HUGE))
+    return false;
+
+  // take every page first, so running out leaves the large page as it was
+  uintptr_t tablePhys = (uintptr_t)__allocpage();
+  if (!tablePhys)
+    return false;
+  uint64_t *table = (uint64_t *)hhdmAdd((void *)tablePhys);
+  for (size_t i = 0; i < 512; ++i) {
+    void *page = pageAlloc(ZONE_NORMAL, 1);
+    if (!page) {
+      while (i-- > 0)
+        pageFree((void *)table[i]);
+      pageFree((void *)tablePhys);
+      return false;
+    }
+    table[i] = (uintptr_t)page;
+  }
+
+  // unmap and flush before copying, or a write through a cached translation
+  // could land in the old frame after its page was copied
+  uint64_t old = *entry;
+  *entry = 0;
+  tlbBatchAdd(batch, base);
+  tlbBatchFlush(batch);
+
+  uint64_t prot = old & (PTE_P | PTE_RW | PTE_US | PTE_NX | PTE_NONE);
+  for (size_t i = 0; i < 512; ++i) {
+    memcpy(hhdmAdd((void *)table[i]), (uint8_t *)hhdmAdd(frame) + i * SIZE_4KB,
+           SIZE_4KB);
+    table[i] |= prot;
+  }
+
+  *entry = tablePhys | PTE_P | PTE_RW | (base < VMM_USER_END ? PTE_US : 0);
+  tlbBatchRelease(batch, frame, vmFlags);
+  return true;
+}
+
+// Make the large page at entry splittable for update, if it can be
+static bool breakLargePage(uint64_t *entry, uintptr_t base, int level,
+                           struct RangeUpdate *update) {
+  if (update->op == RANGE_COPY)
+    return false;
+  if (update->vmFlags & VM_ANON)
+    return demoteLargePage(entry, base, level, update->vmFlags, update->batch);
+  return splitLargePage(entry, base, level, update->batch);
+}
+
+static void updateLeaf(uint64_t *entry, uintptr_t vaddr, int level,
+                       struct RangeUpdate *update) {
+  void *frame = (void *)(*entry & ENTRY_ADDR_MASK);
+  bool anon = update->vmFlags & VM_ANON;
+  bool cow = anon && (update->vmFlags & VM_PRIVATE);
+
+  switch (update->op) {
+  case RANGE_UNMAP:
+    *entry = 0;
+    tlbBatchAdd(update->batch, vaddr);
+    if (anon)
+      tlbBatchRelease(update->batch, frame, update->vmFlags);
+    break;
+
+  case RANGE_PROTECT: {
+    uint64_t pte = update->pte;
+    // a frame still shared copy-on-write has to stay read-only
+    if (cow && (pte & PTE_RW) && vmmFrameRefCount(frame, update->vmFlags) > 1)
+      pte &= ~PTE_RW;
+    uint64_t keep = *entry & ~(PTE_P | PTE_RW | PTE_US | PTE_NX | PTE_NONE);
+    *entry = keep | pte;
+    tlbBatchAdd(update->batch, vaddr);
+    break;
+  }
+
+  case RANGE_COPY: {
+    // both sides lose write access until the first write fault copies
+    if (cow)
+      *entry &= ~PTE_RW;
+    uint64_t flags = *entry & ~ENTRY_ADDR_MASK & ~PTE_PS;
+    if (!mapSinglePage(update->dst->pml4, (uintptr_t)frame, vaddr, level,
+                       flags)) {
+      update->failed = true;
+      break;
+    }
+    if (anon)
+      vmmFrameGet(frame, update->vmFlags);
+    break;
+  }
+  }
+}
+
+// Apply update to the leaf entries translating [start, end) below table, a
+// table at level; returns true if table ended up empty
+static bool updateRange(uint64_t *table, int level, uintptr_t start,
+                        uintptr_t end, struct RangeUpdate *update) {
+  size_t span = 1ULL << (12 + 9 * level);
+  uintptr_t addr = start;
+
+  while (addr < end && !update->failed) {
+    uintptr_t entryBase = __aligndown(addr, span);
+    uintptr_t next = entryBase + span;
+    if (next < entryBase || next > end) // wrapped past the top, or clipped
+      next = end;
+
+    int idx = getIndex(addr, level);
+    uint64_t *entry = &table[idx];
+    if (!pteMapped(*entry)) {
+      addr = next;
+      continue;
+    }
+
+    bool partial = addr != entryBase || next - entryBase != span;
+    if (level > 0 && (*entry & PTE_PS) && partial &&
+        !breakLargePage(entry, entryBase, level, update)) {
+      printfError("0x%lx-0x%lx cuts a large page that can't be split\n",
+                  start, end);
+      update->failed = true;
+      break;
+    }
+
+    if (level == 0 || (*entry & PTE_PS)) {
+      updateLeaf(entry, entryBase, level, update);
     } else {
-      // Need to create a new table. makeNewEntry returns the physical address
-      // of the new child table.
-      uintptr_t *childPhysPtr = makeNewEntry(vtable, paddr, vaddr, lvl);
-      if (!childPhysPtr) {
-        printfError("makeNewEntry failed at level %lu\n", lvl);
-        return false;
+      uintptr_t childPhys = *entry & ENTRY_ADDR_MASK;
+      uint64_t *child = (uint64_t *)hhdmAdd((void *)childPhys);
+      bool empty = updateRange(child, level - 1, addr, next, update);
+
+      // kernel-half PDPTs are shared by every address space, keep them
+      bool shared = level == 3 && idx >= VMM_KERNEL_PML4_START;
+      if (update->op == RANGE_UNMAP && empty && !shared) {
+        *entry = 0;
+        // the flush also drops paging-structure caches pointing at it
+        tlbBatchAdd(update->batch, addr);
+        tlbBatchRelease(update->batch, (void *)childPhys, 0);
       }
+    }
+    addr = next;
+  }
 
-      // Sentinel (1) should never occur in intermediate levels
-      if (childPhysPtr == (uintptr_t *)1) {
-        printfError("unexpected sentinel from makeNewEntry at level %lu\n",
-                    lvl);
-        return false;
-      }
+  return tableEmpty(table);
+}
 
-      uintptr_t childPhysValue = (uintptr_t)childPhysPtr;
-      vtable = (uintptr_t *)hhdmAdd((void *)childPhysValue);
+static bool unmapBatched(struct AddressSpace *as, uintptr_t start,
+                         size_t size, uint32_t vmFlags,
+                         struct TLBBatch *batch) {
+  struct RangeUpdate update = {
+      .op = RANGE_UNMAP, .vmFlags = vmFlags, .batch = batch};
+  updateRange(as->pml4, 3, start, start + size, &update);
+  return !update.failed;
+}
+
+bool vmmBreakLargePages(struct AddressSpace *as, uintptr_t at,
+                        uint32_t vmFlags) {
+  struct TLBBatch batch;
+  tlbBatchInit(&batch, as);
+  struct RangeUpdate update = {
+      .op = RANGE_UNMAP, .vmFlags = vmFlags, .batch = &batch};
+
+  // a 1 GiB page breaks into 2 MiB ones, which may need breaking in turn
+  bool ok = true;
+  for (int level = 2; level >= 1 && ok; --level) {
+    size_t span = 1ULL << (12 + 9 * level);
+    uint64_t *entry = vmmEntryAt(as, at, level);
+    if (!entry || !pteMapped(*entry) || !(*entry & PTE_PS) ||
+        (at & (span - 1)) == 0)
+      continue;
+    ok = breakLargePage(entry, __aligndown(at, span), level, &update);
+  }
+
+  tlbBatchFlush(&batch);
+  return ok;
+}
+
+void vmmUnmapPages(struct AddressSpace *as, uintptr_t start, size_t size,
+                   uint32_t vmFlags) {
+  struct TLBBatch batch;
+  tlbBatchInit(&batch, as);
+  unmapBatched(as, start, size, vmFlags, &batch);
+  tlbBatchFlush(&batch);
+}
+
+void vmmProtectPages(struct AddressSpace *as, uintptr_t start, size_t size,
+                     uint32_t vmFlags) {
+  struct TLBBatch batch;
+  tlbBatchInit(&batch, as);
+  struct RangeUpdate update = {.op = RANGE_PROTECT,
+                               .vmFlags = vmFlags,
+                               .pte = vmFlagsToPte(vmFlags),
+                               .batch = &batch};
+  updateRange(as->pml4, 3, start, start + size, &update);
+  tlbBatchFlush(&batch);
+}
+
+bool vmmCopyPages(struct AddressSpace *dst, struct AddressSpace *src,
+                  uintptr_t start, size_t size, uint32_t vmFlags) {
+  struct RangeUpdate update = {
+      .op = RANGE_COPY, .vmFlags = vmFlags, .dst = dst};
+  updateRange(src->pml4, 3, start, start + size, &update);
+  return !update.failed;
+}
+
+int kunmap(void *vptr, size_t size) {
+  struct AddressSpace *as = &kernelAddressSpace;
+  uintptr_t start = __aligndown((uintptr_t)vptr, SIZE_4KB);
+  uintptr_t end = __alignup((uintptr_t)vptr + size, SIZE_4KB);
+  if (size == 0 || start < VMM_USER_END || end <= start)
+    return -1;
+  size = end - start;
+
+  spinLock(&as->lock);
+
+  // refuse before anything is changed
+  for (struct VMMNode *node = vmmFindNodeOverlapping(as, start, size);
+       node && node->vaddr < end; node = vmmNextNode(as, node)) {
+    if (node->flags & VM_PERMANENT) {
+      spinUnlock(&as->lock);
+      printfError("kunmap: 0x%lx-0x%lx holds a permanent mapping\n", start,
+                  end);
+      return -1;
     }
   }
 
+  // break large pages straddling the edges before any node changes, so
+  // running out of memory here leaves everything as it was
+  struct VMMNode *first = vmmFindNodeContaining(as, start);
+  struct VMMNode *last = vmmFindNodeContaining(as, end);
+  if ((first && !vmmBreakLargePages(as, start, first->flags)) ||
+      (last && !vmmBreakLargePages(as, end, last->flags)))
+    goto nomem;
+
+  // cut the mappings at the edges of the range
+  if (first && first->vaddr < start && !vmmSplitNode(as, first, start))
+    goto nomem;
+  last = vmmFindNodeContaining(as, end);
+  if (last && last->vaddr < end && !vmmSplitNode(as, last, end))
+    goto nomem;
+
+  // one batch for the whole range, so a large unmap costs one CR3 reload
+  struct TLBBatch batch;
+  tlbBatchInit(&batch, as);
+  struct VMMNode *node;
+  bool ok = true;
+  while (ok && (node = vmmFindNodeOverlapping(as, start, size))) {
+    // a node whose pages are still mapped must stay, or its range could be
+    // handed out again under live translations
+    ok = unmapBatched(as, node->vaddr, node->size, node->flags, &batch);
+    if (ok) {
+      vmmDelete(as, node);
+      mempoolFree(&vmmNodePool, node);
+    }
+  }
+  tlbBatchFlush(&batch);
+
+  spinUnlock(&as->lock);
+  if (!ok)
+    printfError("kunmap: 0x%lx-0x%lx only partly unmapped\n", start, end);
+  return ok ? 0 : -1;
+
+nomem:
+  spinUnlock(&as->lock);
+  printfError("kunmap: out of memory splitting 0x%lx-0x%lx\n", start, end);
+  return -1;
+}
+
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Atomic Mappings
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Every CPU owns KMAP_ATOMIC_SLOTS pages of the fixmap window and uses them as
+ * a stack, so nested users (an interrupt handler mapping a page while the code
+ * it interrupted holds one) pop in order. The page table behind the window is
+ * built at boot, and a slot is only ever touched by its own CPU: mapping is
+ * one PTE write, unmapping one PTE write and a local invlpg.
+ */
+_Static_assert(CPU_MAX * KMAP_ATOMIC_SLOTS <= 512,
+               "the fixmap window must fit one page table");
+
+static uint64_t *fixmapTable;
+static uint8_t kmapAtomicDepth[CPU_MAX];
+
+__init void kmapAtomicInit() {
+  struct AddressSpace *as = &kernelAddressSpace;
+  size_t size = CPU_MAX * KMAP_ATOMIC_SLOTS * SIZE_4KB;
+
+  fixmapTable = (uint64_t *)walkCreate(as->pml4, VMM_FIXMAP_START, 0);
+  if (!fixmapTable)
+    panic("Failed to build the fixmap page table\n");
+
+  // keep kmap() and friends out of the window
+  struct VMMNode *node = mempoolAlloc(&vmmNodePool);
+  if (!node)
+    panic("Failed to reserve the fixmap window\n");
+  node->vaddr = VMM_FIXMAP_START;
+  node->paddr = 0;
+  node->size = size;
+  node->flags = VM_FIXED_NOREPLACE | VM_KMAP | VM_WRITE | VM_READ;
+  spinLock(&as->lock);
+  vmmInsertMerge(as, node);
+  spinUnlock(&as->lock);
+}
+
+void *kmapAtomic(uintptr_t paddr) {
+  uint32_t cpu = cpuGetID();
+  uint8_t depth = kmapAtomicDepth[cpu];
+  if (depth == KMAP_ATOMIC_SLOTS)
+    panic("kmapAtomic: CPU %u has all %u slots in use\n", cpu,
+          KMAP_ATOMIC_SLOTS);
+  // claim the slot first, so an interrupt arriving now takes the next one
+  kmapAtomicDepth[cpu] = depth + 1;
+  __asm__ volatile("" ::: "memory");
+
+  size_t slot = cpu * KMAP_ATOMIC_SLOTS + depth;
+  // the slot was invalidated when it was last released, nothing to flush
+  fixmapTable[slot] = (paddr & ENTRY_ADDR_MASK) | PTE_P | PTE_RW | PTE_G |
+                      (vmmNxEnabled ? PTE_NX : 0);
+  return (void *)(VMM_FIXMAP_START + slot * SIZE_4KB + (paddr & 0xFFF));
+}
+
+void kunmapAtomic(void *vptr) {
+  uint32_t cpu = cpuGetID();
+  size_t slot = ((uintptr_t)vptr - VMM_FIXMAP_START) / SIZE_4KB;
+  uint8_t depth = kmapAtomicDepth[cpu];
+
+#ifndef NDEBUG
+  if (depth == 0 || slot != cpu * KMAP_ATOMIC_SLOTS + depth - 1)
+    panic("kunmapAtomic: %p is not the last atomic mapping of CPU %u\n",
+          vptr, cpu);
+#endif
+
+  fixmapTable[slot] = 0;
+  invlpg(VMM_FIXMAP_START + slot * SIZE_4KB);
+  __asm__ volatile("" ::: "memory");
+  kmapAtomicDepth[cpu] = depth - 1;
+}
+
+static bool mapSinglePage(uint64_t *pml4, uintptr_t paddr, uintptr_t vaddr,
+                          int targetLevel, uint64_t pteFlags) {
+  uintptr_t *vtable = walkCreate(pml4, vaddr, targetLevel);
+  if (!vtable)
+    return false;
+
   // Now vtable is the correct table at targetLevel (virtual)
-  // Write the final mapping or large page
+  // Write the final mapping or large page. The kernel half looks the same in
+  // every address space, so its leaves are global
+  if (vaddr >= VMM_USER_END)
+    pteFlags |= PTE_G;
   if (targetLevel == 0) {
     int idx = getIndex(vaddr, 0);
     if (idx < 0)
       return false;
-    vtable[idx] = (paddr & ENTRY_ADDR_MASK) | PTE_P | PTE_RW;
+    vtable[idx] = (paddr & ENTRY_ADDR_MASK) | pteFlags;
   } else if (targetLevel == 1) {
     if ((paddr & (SIZE_2MB - 1)) != 0 || (vaddr & (SIZE_2MB - 1)) != 0) {
       printfError("2MB mapping requires 2MB alignment\n");
@@ -157,7 +636,7 @@ static bool mapSinglePage(uintptr_t paddr, uintptr_t vaddr, int targetLevel) {
     int idx = getIndex(vaddr, 1);
     if (idx < 0)
       return false;
-    vtable[idx] = (paddr & ENTRY_ADDR_MASK) | PTE_P | PTE_RW | PTE_PS;
+    vtable[idx] = (paddr & ENTRY_ADDR_MASK) | pteFlags | PTE_PS;
   } else if (targetLevel == 2) {
     if ((paddr & (SIZE_1GB - 1)) != 0 || (vaddr & (SIZE_1GB - 1)) != 0) {
       printfError("1GB mapping requires 1GB alignment\n");
@@ -166,7 +645,7 @@ static bool mapSinglePage(uintptr_t paddr, uintptr_t vaddr, int targetLevel) {
     int idx = getIndex(vaddr, 2);
     if (idx < 0)
       return false;
-    vtable[idx] = (paddr & ENTRY_ADDR_MASK) | PTE_P | PTE_RW | PTE_PS;
+    vtable[idx] = (paddr & ENTRY_ADDR_MASK) | pteFlags | PTE_PS;
   } else {
     return false;
   }
@@ -174,6 +653,50 @@ static bool mapSinglePage(uintptr_t paddr, uintptr_t vaddr, int targetLevel) {
   return true;
 }
 
+// Walk down to the table at targetLevel, creating missing tables on the way.
+// Returns it as a virtual pointer, or NULL on failure.
+static uintptr_t *walkCreate(uint64_t *pml4, uintptr_t vaddr,
+                             int targetLevel) {
+  // pml4 is a virtual pointer
+  uintptr_t *vtable = (uintptr_t *)pml4;
+
+  // Iterate from PML4 (level 3) down to targetLevel+1 to ensure all
+  // intermediate tables exist
+  for (int lvl = 3; lvl > targetLevel; --lvl) {
+    uintptr_t childPhys = 0;
+    if (getExistingEntry(vtable, &childPhys, vaddr, lvl)) {
+      // Child table exists → descend into it; childPhys holds physical addr
+      vtable = (uintptr_t *)hhdmAdd((void *)childPhys);
+    } else {
+      // Need to create a new table. makeNewEntry returns the physical address
+      // of the new child table.
+      uintptr_t *childPhysPtr = makeNewEntry(vtable, 0, vaddr, lvl);
+      if (!childPhysPtr) {
+        printfError("makeNewEntry failed at level %lu\n", lvl);
+        return NULL;
+      }
+
+      // Sentinel (1) should never occur in intermediate levels
+      if (childPhysPtr == (uintptr_t *)1) {
+        printfError("unexpected sentinel from makeNewEntry at level %lu\n",
+                    lvl);
+        return NULL;
+      }
+
+      // a new kernel-half PML4 entry must show up in every address space
+      if (lvl == 3 && pml4 == kernelAddressSpace.pml4 &&
+          getIndex(vaddr, 3) >= VMM_KERNEL_PML4_START)
+        addressSpaceSyncKernel(getIndex(vaddr, 3));
+
+      uintptr_t childPhysValue = (uintptr_t)childPhysPtr;
+      vtable = (uintptr_t *)hhdmAdd((void *)childPhysValue);
+    }
+  }
+
+
+  return vtable;
+}
+
 // Returns child table physical address (cast as pointer), or NULL on failure.
 // For targetLevel == 0 (final PTE), writes the PTE and returns (uintptr_t*)1 as
 // a success sentinel.
@@ -206,7 +729,10 @@ static uintptr_t *makeNewEntry(uintptr_t *table, uintptr_t paddr,
     for (int i = 0; i < 512; ++i)
       newTableVirt[i] = 0;
 
-    table[idx] = (newTablePhys & ENTRY_ADDR_MASK) | PTE_P | PTE_RW;
+    // tables are permissive; the leaf entry decides, but user mappings need
+    // the user bit at every level
+    table[idx] = (newTablePhys & ENTRY_ADDR_MASK) | PTE_P | PTE_RW |
+                 (vaddr < VMM_USER_END ? PTE_US : 0);
 
     return (uintptr_t *)newTablePhys;
   }
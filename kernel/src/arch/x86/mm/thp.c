@@ -0,0 +1,122 @@
+#include <macros.h>
+#include <mm/hhdm.h>
+#include <mm/pmm.h>
+#include <mm/thp.h>
+#include <mm/vmm.h>
+#include <mm/zone.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdmem.h>
+#include <x86/page_table.h>
+
+extern size_t pagePhysicalMask;
+
+#define THP_PAGES (SIZE_2MB / SIZE_4KB)
+
+// Bits that have to match across the 512 entries, and carry over to the
+// large one
+#define THP_PROT_BITS (PTE64_PRESENT | PTE64_RW | PTE64_US | PTE64_PWT | \
+                       PTE64_PCD | PTE64_NX)
+
+enum CollapseResult {
+  COLLAPSE_SKIPPED,
+  COLLAPSE_DONE,
+  COLLAPSE_NO_MEMORY
+};
+
+// Page directory entry of [start, start + 2 MiB) if that region is a table of
+// 512 present, unshared pages with one protection
+static uint64_t *collapsible(struct AddressSpace *as, uintptr_t start,
+                             uint64_t *prot) {
+  uint64_t *pde = vmmEntryAt(as, start, 1);
+  if (!pde || !(*pde & PD64_PRESENT) || (*pde & PD64_PS))
+    return NULL;
+
+  uint64_t *pt = hhdmAdd((void *)(*pde & pagePhysicalMask));
+  uint64_t first = pt[0] & THP_PROT_BITS;
+  if (!(first & PTE64_PRESENT))
+    return NULL;
+
+  for (size_t i = 0; i < THP_PAGES; ++i) {
+    if ((pt[i] & THP_PROT_BITS) != first)
+      return NULL;
+    if (pageRefCount((void *)(pt[i] & pagePhysicalMask)) != 1)
+      return NULL;
+  }
+
+  *prot = first;
+  return pde;
+}
+
+static enum CollapseResult collapseRegion(struct AddressSpace *as,
+                                          uintptr_t start) {
+  uint64_t prot;
+  uint64_t *pde = collapsible(as, start, &prot);
+  if (!pde)
+    return COLLAPSE_SKIPPED;
+
+  void *block = pageAllocAligned(ZONE_NORMAL, THP_PAGES, SIZE_2MB);
+  if (!block)
+    return COLLAPSE_NO_MEMORY;
+
+  uintptr_t ptPhys = *pde & pagePhysicalMask;
+  uint64_t *pt = hhdmAdd((void *)ptPhys);
+
+  // unmap the region and flush before copying: a write through a cached
+  // 4 KiB translation after the copy would be lost. Anyone touching it now
+  // faults and waits for as->lock, then finds the large page
+  *pde = 0;
+  vmmFlushAll(as);
+
+  uint8_t *dst = hhdmAdd(block);
+  for (size_t i = 0; i < THP_PAGES; ++i)
+    memcpy(dst + i * SIZE_4KB, hhdmAdd((void *)(pt[i] & pagePhysicalMask)),
+           SIZE_4KB);
+
+  *pde = (uintptr_t)block | prot | PD64_PS | PD64_ACCESSED | PD64_DIRTY;
+
+  for (size_t i = 0; i < THP_PAGES; ++i)
+    pagePut((void *)(pt[i] & pagePhysicalMask));
+  pageFree((void *)ptPhys);
+  return COLLAPSE_DONE;
+}
+
+size_t thpCollapseScan(struct AddressSpace *as, size_t maxRegions) {
+  size_t scanned = 0, collapsed = 0;
+
+  spinLock(&as->lock);
+  uintptr_t cursor = as->collapseCursor;
+  struct VMMNode *node =
+      vmmFindNodeOverlapping(as, cursor, UINTPTR_MAX - cursor);
+
+  while (node && scanned < maxRegions) {
+    uintptr_t end = node->vaddr + node->size;
+
+    // only anonymous memory can be moved to other frames
+    if (node->flags & VM_ANON) {
+      uintptr_t from = node->vaddr > cursor ? node->vaddr : cursor;
+      for (uintptr_t r = __alignup(from, SIZE_2MB);
+           r + SIZE_2MB <= end && scanned < maxRegions; r += SIZE_2MB) {
+        scanned++;
+        cursor = r + SIZE_2MB;
+
+        enum CollapseResult result = collapseRegion(as, r);
+        if (result == COLLAPSE_NO_MEMORY)
+          goto out;
+        if (result == COLLAPSE_DONE)
+          collapsed++;
+      }
+      if (scanned >= maxRegions)
+        break;
+    }
+
+    cursor = end;
+    node = vmmNextNode(as, node);
+  }
+
+out:
+  // past the last mapping: start over next time
+  as->collapseCursor = node ? cursor : 0;
+  spinUnlock(&as->lock);
+  return collapsed;
+}
\ No newline at end of file
@@ -0,0 +1,321 @@
+#include <cpu/topology.h>
+#include <macros.h>
+#include <mm/hhdm.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <printf.h>
+#include <spinlock.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <x86/apic.h>
+#include <x86/cpuid.h>
+#include <x86/cr.h>
+#include <x86/idt.h>
+#include <x86/tlb.h>
+
+#define CPUID_1_EDX_PGE (1 << 13)
+#define CPUID_1_ECX_PCID (1 << 17)
+#define CPUID_7_EBX_INVPCID (1 << 10)
+
+enum INVPCIDType {
+  INVPCID_ADDRESS = 0,
+  INVPCID_CONTEXT = 1,
+  INVPCID_ALL = 2, // every PCID, global entries too
+};
+
+static bool globalPages = false;
+static bool pcidEnabled = false;
+static bool invpcidSupported = false;
+
+struct PCIDAllocator {
+  uint64_t generation;
+  uint32_t next;
+} __alignment(64);
+
+static struct PCIDAllocator pcidAllocators[CPU_MAX];
+
+static inline void invpcid(enum INVPCIDType type, uint16_t pcid,
+                           uintptr_t vaddr) {
+  struct {
+    uint64_t pcid;
+    uint64_t vaddr;
+  } desc = {pcid, vaddr};
+  asm volatile("invpcid %0, %1" ::"m"(desc), "r"((uint64_t)type) : "memory");
+}
+
+// Drop every non-global entry of the loaded PCID
+static inline void reloadCR3() { writeCR3(readCR3() & ~CR3_NOFLUSH); }
+
+// Drop every entry of every PCID
+static void flushEverything() {
+  if (invpcidSupported) {
+    invpcid(INVPCID_ALL, 0, 0);
+    return;
+  }
+  // any change to CR4.PGE flushes the whole TLB
+  uint64_t cr4 = readCR4();
+  writeCR4(cr4 ^ CR4_PGE);
+  writeCR4(cr4);
+}
+
+static void flushKernel(const uintptr_t *vaddrs, size_t count, bool full) {
+  // kernel-half entries are global, which a CR3 reload leaves alone; invlpg
+  // drops a global entry whatever PCID is loaded. Without global pages they
+  // may sit under every PCID, and invlpg only reaches the loaded one
+  if (full || (pcidEnabled && !globalPages)) {
+    flushEverything();
+    return;
+  }
+  for (size_t i = 0; i < count; ++i)
+    invlpg(vaddrs[i]);
+}
+
+static void flushLocal(struct AddressSpace *as, const uintptr_t *vaddrs,
+                       size_t count, bool full) {
+  if (as == &kernelAddressSpace) {
+    flushKernel(vaddrs, count, full);
+    return;
+  }
+
+  if (as == addressSpaceCurrent()) {
+    if (full) {
+      reloadCR3();
+      return;
+    }
+    for (size_t i = 0; i < count; ++i)
+      invlpg(vaddrs[i]);
+    return;
+  }
+
+  // not loaded, but its entries may still sit under the PCID it owns here
+  if (!pcidEnabled)
+    return;
+  uint32_t cpu = cpuGetID();
+  struct TLBContext *ctx = &as->tlb[cpu];
+  if (pcidAllocators[cpu].generation == 0 ||
+      ctx->generation != pcidAllocators[cpu].generation)
+    return;
+  if (!invpcidSupported) {
+    ctx->generation = 0; // flushed when it gets a new one
+  } else if (full) {
+    invpcid(INVPCID_CONTEXT, ctx->pcid, 0);
+  } else {
+    for (size_t i = 0; i < count; ++i)
+      invpcid(INVPCID_ADDRESS, ctx->pcid, vaddrs[i]);
+  }
+}
+
+void tlbLoad(struct AddressSpace *as) {
+  uint32_t cpu = cpuGetID();
+  struct PCIDAllocator *alloc = &pcidAllocators[cpu];
+  uintptr_t physAddr = hhdmRemoveAddr((uintptr_t)as->pml4);
+  // generation 0: this CPU hasn't turned PCIDs on (yet)
+  if (!pcidEnabled || alloc->generation == 0) {
+    writeCR3(physAddr);
+    return;
+  }
+
+  struct TLBContext *ctx = &as->tlb[cpu];
+  if (__atomic_load_n(&ctx->generation, __ATOMIC_SEQ_CST) ==
+      alloc->generation) {
+    writeCR3(physAddr | ctx->pcid | CR3_NOFLUSH);
+    return;
+  }
+
+  // out of PCIDs: everyone holding one of the old generation loses it.
+  // Their entries can stay, a PCID is flushed whenever it is handed out
+  if (alloc->next == TLB_PCID_COUNT) {
+    alloc->generation++;
+    alloc->next = 1;
+  }
+  ctx->pcid = alloc->next++;
+  __atomic_store_n(&ctx->generation, alloc->generation, __ATOMIC_SEQ_CST);
+  writeCR3(physAddr | ctx->pcid);
+}
+
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Shootdown
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * One shootdown is in flight at a time. The sender fills shootdownRequest,
+ * raises the pending flag of every target and sends the IPIs; each target
+ * flushes what the request describes and clears its own flag, which is all
+ * the sender waits on.
+ */
+static struct Spinlock shootdownLock = SPINLOCK_INIT;
+
+static struct {
+  struct AddressSpace *as;
+  size_t count;
+  bool full;
+  uintptr_t vaddrs[TLB_FLUSH_THRESHOLD];
+} shootdownRequest;
+
+struct ShootdownAck {
+  volatile uint32_t pending;
+} __alignment(64);
+
+static struct ShootdownAck shootdownAcks[CPU_MAX];
+
+// Flush for the request in flight if it includes the calling CPU
+static void shootdownServe() {
+  struct ShootdownAck *ack = &shootdownAcks[cpuGetID()];
+  if (!__atomic_load_n(&ack->pending, __ATOMIC_ACQUIRE))
+    return;
+  flushLocal(shootdownRequest.as, shootdownRequest.vaddrs,
+             shootdownRequest.count, shootdownRequest.full);
+  __atomic_store_n(&ack->pending, 0, __ATOMIC_RELEASE);
+}
+
+static void shootdownHandler(struct InterruptFrame *frame) {
+  (void)frame;
+  shootdownServe();
+  lapicEOI();
+}
+
+void tlbSpinLock(struct Spinlock *lock) {
+  while (!spinTryLock(lock))
+    shootdownServe();
+}
+
+static void flushRemote(struct AddressSpace *as, const uintptr_t *vaddrs,
+                        size_t count, bool full) {
+  uint32_t self = cpuGetID();
+  uint64_t targets = as == &kernelAddressSpace
+                         ? __atomic_load_n(&cpuOnlineMask, __ATOMIC_SEQ_CST)
+                         : __atomic_load_n(&as->cpuMask, __ATOMIC_SEQ_CST);
+  targets &= ~(1ULL << self);
+
+  // CPUs that ran as before may still hold its entries under their PCID for
+  // it. Take those PCIDs away before looking at who has it loaded: a CPU
+  // loading as concurrently either shows up in cpuMask or sees its PCID gone
+  if (pcidEnabled && as != &kernelAddressSpace) {
+    uint64_t online = __atomic_load_n(&cpuOnlineMask, __ATOMIC_SEQ_CST);
+    for (uint64_t left = online & ~(1ULL << self); left; left &= left - 1)
+      __atomic_store_n(&as->tlb[__builtin_ctzll(left)].generation, 0,
+                       __ATOMIC_SEQ_CST);
+    targets = __atomic_load_n(&as->cpuMask, __ATOMIC_SEQ_CST) &
+              ~(1ULL << self);
+  }
+  if (!targets)
+    return;
+
+  // whoever holds the lock may be waiting on us, possibly with interrupts
+  // off here, so answer it while we wait
+  tlbSpinLock(&shootdownLock);
+
+  shootdownRequest.as = as;
+  shootdownRequest.count = full ? 0 : count;
+  shootdownRequest.full = full;
+  for (size_t i = 0; i < shootdownRequest.count; ++i)
+    shootdownRequest.vaddrs[i] = vaddrs[i];
+
+  for (uint64_t left = targets; left; left &= left - 1) {
+    uint32_t cpu = __builtin_ctzll(left);
+    __atomic_store_n(&shootdownAcks[cpu].pending, 1, __ATOMIC_RELEASE);
+    lapicSendIPI(cpu, IPI_TLB_SHOOTDOWN);
+  }
+
+  for (uint64_t left = targets; left; left &= left - 1) {
+    uint32_t cpu = __builtin_ctzll(left);
+    while (__atomic_load_n(&shootdownAcks[cpu].pending, __ATOMIC_ACQUIRE))
+      __asm__ volatile("pause");
+  }
+
+  spinUnlock(&shootdownLock);
+}
+
+static void flush(struct AddressSpace *as, const uintptr_t *vaddrs,
+                  size_t count, bool full) {
+  flushLocal(as, vaddrs, count, full);
+  flushRemote(as, vaddrs, count, full);
+}
+
+void tlbInit() {
+  registerInterruptHandler(IPI_TLB_SHOOTDOWN, shootdownHandler);
+
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+  // kernel-half leaves are mapped global already; let them survive CR3 loads
+  if (edx & CPUID_1_EDX_PGE) {
+    writeCR4(readCR4() | CR4_PGE);
+    globalPages = true;
+  }
+
+  if (!(ecx & CPUID_1_ECX_PCID))
+    return;
+  cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+  invpcidSupported = (ebx & CPUID_7_EBX_INVPCID) != 0;
+
+  // PCIDE can only be set while CR3 uses PCID 0; everything until now did
+  struct PCIDAllocator *alloc = &pcidAllocators[cpuGetID()];
+  alloc->generation = 1;
+  alloc->next = 1;
+  writeCR4(readCR4() | CR4_PCIDE);
+  pcidEnabled = true;
+
+#ifndef NDEBUG
+  printfDebug("TLB: PCIDs enabled%s\n", invpcidSupported ? ", INVPCID" : "");
+#endif
+}
+
+void vmmFlushPage(struct AddressSpace *as, uintptr_t vaddr) {
+  flush(as, &vaddr, 1, false);
+}
+
+void vmmFlushAll(struct AddressSpace *as) { flush(as, NULL, 0, true); }
+
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Batches
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlbBatchInit(struct TLBBatch *batch, struct AddressSpace *as) {
+  batch->as = as;
+  batch->count = 0;
+  batch->full = false;
+  batch->releaseCount = 0;
+}
+
+void tlbBatchAdd(struct TLBBatch *batch, uintptr_t vaddr) {
+  if (batch->full)
+    return;
+  if (batch->count == TLB_FLUSH_THRESHOLD) {
+    batch->full = true;
+    return;
+  }
+  batch->vaddrs[batch->count++] = vaddr;
+}
+
+void tlbBatchRelease(struct TLBBatch *batch, void *paddr, uint32_t vmFlags) {
+  if (batch->releaseCount == TLB_BATCH_RELEASE)
+    tlbBatchFlush(batch);
+
+  // paging-structure caches are never global: a freed kernel table may be
+  // cached under any PCID, and only a full flush reaches them all
+  if (!vmFlags && pcidEnabled && batch->as == &kernelAddressSpace)
+    batch->full = true;
+
+  batch->release[batch->releaseCount].paddr = paddr;
+  batch->release[batch->releaseCount].vmFlags = vmFlags;
+  batch->releaseCount++;
+}
+
+void tlbBatchFlush(struct TLBBatch *batch) {
+  // every CPU that may cache these must be done before anything is released
+  if (batch->count || batch->full)
+    flush(batch->as, batch->vaddrs, batch->count, batch->full);
+
+  for (size_t i = 0; i < batch->releaseCount; ++i) {
+    struct TLBRelease *r = &batch->release[i];
+    if (r->vmFlags)
+      vmmFramePut(r->paddr, r->vmFlags);
+    else
+      pageFree(r->paddr);
+  }
+
+  batch->count = 0;
+  batch->full = false;
+  batch->releaseCount = 0;
+}
\ No newline at end of file
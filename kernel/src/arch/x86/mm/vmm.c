@@ -1,10 +1,14 @@
+#include <arch-hook.h>
 #include <basic_io.h>
+#include <cpu/topology.h>
 #include <kernel_info.h>
 #include <macros.h>
 #include <mm/hhdm.h>
+#include <mm/hugepage.h>
 #include <mm/kmap.h>
 #include <mm/memmap.h>
 #include <mm/pmm.h>
+#include <mm/slub.h>
 #include <mm/vmm.h>
 #include <mm/zone.h>
 #include <panic.h>
@@ -14,7 +18,9 @@
 #include <stdint.h>
 #include <stdmem.h>
 #include <x86/cpuid.h>
+#include <x86/msr.h>
 #include <x86/page_table.h>
+#include <x86/tlb.h>
 
 extern uint8_t __kernelStart;
 extern uint8_t __kernelEnd;
@@ -37,16 +43,12 @@ extern uint8_t __dataSectionEnd;
 size_t pagePhysicalMask;
 size_t pagePhysicalBits;
 size_t pageVirtualBits;
+bool vmmNxEnabled;
 
-#ifdef ARCH_64
-uint64_t *root;
-#else
-#ifndef X86_NO_PAE
-uint32_t root[1024] __alignment(4096);
-#else
-uint64_t root[4] __alignment(32);
-#endif
-#endif
+// Every address space, so kernel-half PML4 entries can be copied into all of them
+static struct AddressSpace *addressSpaceList = NULL;
+static struct Spinlock addressSpaceListLock = SPINLOCK_INIT;
+static struct AddressSpace *currentAddressSpace[CPU_MAX];
 
 __init static void mapMemories();
 __init static void mapMemoryMap(struct MemoryEntries *entries);
@@ -58,56 +60,249 @@ void vmmInit() {
   pageVirtualBits = (eax >> 8) & 0xFF;
   pagePhysicalBits = eax & 0xFF;
   pagePhysicalMask = ((1ULL << pagePhysicalBits) - 1) & ~0xFFFULL;
+  vmmNxEnabled = (rdmsr(MSR_EFER) & EFER_NXE) != 0;
 
-  root = pageAlloc(ZONE_NORMAL, 1);
-  if (!root) {
-    panic("Failed to alloc PML4: 0x%lx\n", root);
+  struct AddressSpace *kas = &kernelAddressSpace;
+  kas->pml4 = pageAlloc(ZONE_NORMAL, 1);
+  if (!kas->pml4) {
+    panic("Failed to alloc PML4: 0x%lx\n", kas->pml4);
     return;
   }
 
-  root = hhdmAdd(root);
-  memset(root, 0, 4096);
-
-#if !defined(ARCH_64) && !defined(X86_NO_PAE)
-  uintpr_t root2 = __aligndown((uintptr_t)root, 32);
-  root = (uint64_t *)root2;
-#endif
-
-  vmmInitRBTree();
+  kas->pml4 = hhdmAdd(kas->pml4);
+  memset(kas->pml4, 0, 4096);
+
+  vmmNodeCache = slubCacheCreate("vmm-node", sizeof(struct VMMNode), 0, NULL);
+  if (!vmmNodeCache)
+    panic("Failed to create VMMNode cache\n");
+  if (!mempoolInitCache(&vmmNodePool, VMM_NODE_RESERVE, vmmNodeCache))
+    panic("Failed to reserve %lu VMMNodes\n", VMM_NODE_RESERVE);
+  if (!rangeTreeSetup())
+    panic("Failed to set up the VMM range index\n");
+
+  vmmInitRBTree(kas);
+  spinInit(&kas->lock);
+  kas->next = NULL;
+  addressSpaceList = kas;
   mapMemories();
+  kmapAtomicInit();
+
+  // the direct map, the kernel image and the boot memory must never go away
+  for (struct VMMNode *node = vmmFindNodeOverlapping(kas, 0, UINTPTR_MAX);
+       node; node = vmmNextNode(kas, node))
+    node->flags |= VM_PERMANENT;
 
-  uintptr_t physAddr = hhdmRemoveAddr((uintptr_t)root);
-  __asm__ volatile("mov %0, %%cr3" ::"r"(physAddr) : "memory");
+  addressSpaceSwitch(kas);
 
   printfInfo("Paging taken over\n");
 }
 
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Address Spaces
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct AddressSpace *addressSpaceCreate() {
+  struct AddressSpace *as = kmalloc(sizeof(*as));
+  if (!as)
+    return NULL;
+
+  void *pml4 = pageAlloc(ZONE_NORMAL, 1);
+  if (!pml4) {
+    kfree(as);
+    return NULL;
+  }
+  as->pml4 = hhdmAdd(pml4);
+  memset(as->pml4, 0, 4096);
+
+  vmmInitRBTree(as);
+  spinInit(&as->lock);
+  as->collapseCursor = 0;
+  as->cpuMask = 0;
+  memset(as->tlb, 0, sizeof(as->tlb));
+
+  // copy the kernel half under the list lock so no sync can slip in between
+  spinLock(&addressSpaceListLock);
+  for (size_t i = VMM_KERNEL_PML4_START; i < 512; ++i)
+    as->pml4[i] = kernelAddressSpace.pml4[i];
+  as->next = addressSpaceList;
+  addressSpaceList = as;
+  spinUnlock(&addressSpaceListLock);
+
+  return as;
+}
+
+void addressSpaceSyncKernel(size_t index) {
+  spinLock(&addressSpaceListLock);
+  uint64_t entry = kernelAddressSpace.pml4[index];
+  for (struct AddressSpace *as = addressSpaceList; as; as = as->next)
+    as->pml4[index] = entry;
+  spinUnlock(&addressSpaceListLock);
+}
+
+// Free a page table and every table below it; level 2 is a PDPT
+static void freeTableTree(uint64_t *table, int level) {
+  for (size_t i = 0; level > 0 && i < 512; ++i) {
+    uint64_t entry = table[i];
+    if ((entry & PTE64_PRESENT) && !(entry & PD64_PS))
+      freeTableTree(hhdmAdd((void *)(entry & pagePhysicalMask)), level - 1);
+  }
+  pageFree(hhdmRemove(table));
+}
+
+void addressSpaceDestroy(struct AddressSpace *as) {
+  if (!as || as == &kernelAddressSpace)
+    return;
+
+  spinLock(&addressSpaceListLock);
+  for (struct AddressSpace **link = &addressSpaceList; *link;
+       link = &(*link)->next) {
+    if (*link == as) {
+      *link = as->next;
+      break;
+    }
+  }
+  spinUnlock(&addressSpaceListLock);
+
+  while (as->tree.root != &as->tree.nil) {
+    struct VMMNode *node = as->tree.root;
+    if ((node->flags & VM_ANON) && node->vaddr < VMM_USER_END)
+      vmmUnmapPages(as, node->vaddr, node->size, node->flags);
+    vmmDelete(as, node);
+    mempoolFree(&vmmNodePool, node);
+  }
+  rangeTreeDestroy(&as->index);
+
+  for (size_t i = 0; i < VMM_KERNEL_PML4_START; ++i) {
+    uint64_t entry = as->pml4[i];
+    if (entry & PTE64_PRESENT)
+      freeTableTree(hhdmAdd((void *)(entry & pagePhysicalMask)), 2);
+  }
+  pageFree(hhdmRemove(as->pml4));
+  kfree(as);
+}
+
+struct AddressSpace *addressSpaceClone(struct AddressSpace *src) {
+  struct AddressSpace *dst = addressSpaceCreate();
+  if (!dst)
+    return NULL;
+
+  // dst isn't visible to anyone yet, so only src needs locking
+  bool ok = true;
+  spinLock(&src->lock);
+  for (struct VMMNode *node = vmmFindNodeOverlapping(src, 0, VMM_USER_END);
+       node && node->vaddr < VMM_USER_END && ok;
+       node = vmmNextNode(src, node)) {
+    struct VMMNode *copy = mempoolAlloc(&vmmNodePool);
+    if (!copy) {
+      ok = false;
+      break;
+    }
+    copy->vaddr = node->vaddr;
+    copy->paddr = node->paddr;
+    copy->size = node->size;
+    copy->flags = node->flags;
+    vmmInsert(dst, copy);
+
+    ok = vmmCopyPages(dst, src, node->vaddr, node->size, node->flags);
+  }
+
+  // src's pages may have just lost write access; reload CR3 rather than
+  // flush them one by one
+  vmmFlushAll(src);
+  spinUnlock(&src->lock);
+
+  if (!ok) {
+    addressSpaceDestroy(dst);
+    return NULL;
+  }
+  return dst;
+}
+
+void addressSpaceSwitch(struct AddressSpace *as) {
+  uint32_t cpu = cpuGetID();
+  struct AddressSpace *old = currentAddressSpace[cpu];
+
+  // join before the tables are read, so no shootdown can miss us; the CR3
+  // load drops whatever old left behind, so leaving can come after
+  __atomic_fetch_or(&as->cpuMask, 1ULL << cpu, __ATOMIC_SEQ_CST);
+  currentAddressSpace[cpu] = as;
+  tlbLoad(as);
+  if (old && old != as)
+    __atomic_fetch_and(&old->cpuMask, ~(1ULL << cpu), __ATOMIC_SEQ_CST);
+}
+
+struct AddressSpace *addressSpaceCurrent() {
+  struct AddressSpace *as = currentAddressSpace[cpuGetID()];
+  return as ? as : &kernelAddressSpace;
+}
+
 // ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Red-Black Tree
 // ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static void rbRotateLeft(struct VMMNode *node);
-static void rbRotateRight(struct VMMNode *node);
-static void rbInsertFixup(struct VMMNode *node);
-static void rbDeleteFixup(struct VMMNode *node);
-static struct VMMNode *rbTreeMinimum(struct VMMNode *node);
+static void rbRotateLeft(struct VMMTree *t, struct VMMNode *node);
+static void rbRotateRight(struct VMMTree *t, struct VMMNode *node);
+static void rbInsertFixup(struct VMMTree *t, struct VMMNode *node);
+static void rbDeleteFixup(struct VMMTree *t, struct VMMNode *node);
+static struct VMMNode *rbTreeMinimum(struct VMMTree *t, struct VMMNode *node);
+static void rbUpdate(struct VMMTree *t, struct VMMNode *node);
+static void rbUpdatePath(struct VMMTree *t, struct VMMNode *node);
+
+// Per-CPU cache of the last nodes vmmFindNodeContaining() returned. Every
+// change to a tree gives its address space a new seq, which empties the
+// caches lazily. Seqs come from one counter that only goes up, so a new
+// address space reusing a freed one's memory can't match what a CPU cached
+// for the old one.
+#define VMM_LOOKUP_CACHE_SIZE 4
+
+struct VMMLookupCache {
+  struct AddressSpace *as;
+  uint64_t seq;
+  uint32_t next; // slot to replace on the next miss
+  uint32_t last; // slot of the most recent hit
+  struct VMMNode *nodes[VMM_LOOKUP_CACHE_SIZE];
+};
+
+static struct VMMLookupCache vmmLookupCache[CPU_MAX];
+static uint64_t vmmLookupSeq = 0;
+
+static inline void vmmInvalidateLookups(struct AddressSpace *as) {
+  as->seq = __atomic_add_fetch(&vmmLookupSeq, 1, __ATOMIC_RELAXED);
+}
+
+static void indexInsert(struct AddressSpace *as, struct VMMNode *node) {
+  if (as->indexValid && node->size > 0 &&
+      !rangeTreeInsert(&as->index, node->vaddr, node->vaddr + node->size,
+                       node)) {
+    printfError("vmm: range index out of memory, using tree lookups\n");
+    as->indexValid = false;
+  }
+}
 
-__init void vmmInitRBTree() {
-  vmmNilNode.color = VMM_RB_NIL;
-  vmmNilNode.flags = 0;
-  vmmNilNode.paddr = 0;
-  vmmNilNode.vaddr = 0;
-  vmmNilNode.size = 0;
-  vmmNilNode.left = &vmmNilNode;
-  vmmNilNode.right = &vmmNilNode;
-  vmmNilNode.parent = &vmmNilNode;
-  vmmTree.root = &vmmNilNode;
+void vmmInitRBTree(struct AddressSpace *as) {
+  struct VMMTree *t = &as->tree;
+  t->nil.color = VMM_RB_NIL;
+  t->nil.flags = 0;
+  t->nil.paddr = 0;
+  t->nil.vaddr = 0;
+  t->nil.size = 0;
+  t->nil.subtreeMinStart = 0;
+  t->nil.subtreeMaxEnd = 0;
+  t->nil.subtreeMaxGap = 0;
+  t->nil.left = &t->nil;
+  t->nil.right = &t->nil;
+  t->nil.parent = &t->nil;
+  t->root = &t->nil;
+
+  rangeTreeInit(&as->index);
+  as->indexValid = true;
+  vmmInvalidateLookups(as);
 }
 
-struct VMMNode *vmmFindNodeContaining(uintptr_t vaddr) {
-  struct VMMNode *node = vmmTree.root;
+static struct VMMNode *rbFindContaining(struct VMMTree *t, uintptr_t vaddr) {
+  struct VMMNode *node = t->root;
 
-  while (node != &vmmNilNode) {
+  while (node != &t->nil) {
     uintptr_t start = node->vaddr;
     uintptr_t end = start + node->size;
 
@@ -123,33 +318,130 @@ struct VMMNode *vmmFindNodeContaining(uintptr_t vaddr) {
   return NULL;
 }
 
-struct VMMNode *vmmFindNodeOverlapping(uintptr_t start, size_t size) {
-  uintptr_t end = start + size;
-  struct VMMNode *node = vmmTree.root;
-
-  while (node != &vmmNilNode) {
-    uintptr_t nStart = node->vaddr;
-    uintptr_t nEnd = nStart + node->size;
-
-    // Check overlap
-    if (start < nEnd && nStart < end)
-      return node;
+static inline bool nodeContains(struct VMMNode *node, uintptr_t vaddr) {
+  return vaddr >= node->vaddr && vaddr - node->vaddr < node->size;
+}
 
-    if (end <= nStart) {
-      node = node->left;
-    } else {
-      node = node->right;
+struct VMMNode *vmmFindNodeContaining(struct AddressSpace *as,
+                                      uintptr_t vaddr) {
+  struct VMMLookupCache *cache = &vmmLookupCache[cpuGetID()];
+  uint64_t seq = as->seq;
+
+  if (cache->as == as && cache->seq == seq) {
+    for (uint32_t i = 0; i < VMM_LOOKUP_CACHE_SIZE; ++i) {
+      struct VMMNode *node = cache->nodes[i];
+      if (node && nodeContains(node, vaddr)) {
+        cache->last = i;
+        return node;
+      }
     }
+  } else {
+    for (uint32_t i = 0; i < VMM_LOOKUP_CACHE_SIZE; ++i)
+      cache->nodes[i] = NULL;
+    cache->as = as;
+    cache->seq = seq;
+  }
+
+  // walking forward off the last region usually lands in the next one
+  struct VMMNode *node = NULL;
+  struct VMMNode *last = cache->nodes[cache->last];
+  if (last && vaddr >= last->vaddr + last->size) {
+    struct VMMNode *next = vmmNextNode(as, last);
+    if (next && nodeContains(next, vaddr))
+      node = next;
   }
 
+  if (!node)
+    node = as->indexValid ? rangeTreeLookup(&as->index, vaddr)
+                          : rbFindContaining(&as->tree, vaddr);
+  if (!node)
+    return NULL;
+
+  cache->nodes[cache->next] = node;
+  cache->last = cache->next;
+  cache->next = (cache->next + 1) % VMM_LOOKUP_CACHE_SIZE;
+  return node;
+}
+
+// Lowest node of the subtree at n overlapping [start, end); subtrees whose
+// span misses the range are skipped
+static struct VMMNode *findOverlapIn(struct VMMTree *t, struct VMMNode *n, uintptr_t start,
+                                     uintptr_t end) {
+  while (n != &t->nil) {
+    if (n->subtreeMaxEnd <= start || n->subtreeMinStart >= end)
+      return NULL;
+
+    struct VMMNode *found = findOverlapIn(t, n->left, start, end);
+    if (found)
+      return found;
+
+    if (start < n->vaddr + n->size && n->vaddr < end)
+      return n;
+
+    // everything on the right starts at or after n
+    if (n->vaddr >= end)
+      return NULL;
+    n = n->right;
+  }
   return NULL;
 }
 
-void vmmInsert(struct VMMNode *node) {
-  struct VMMNode *y = &vmmNilNode;
-  struct VMMNode *x = vmmTree.root;
+struct VMMNode *vmmFindNodeOverlapping(struct AddressSpace *as,
+                                       uintptr_t start, size_t size) {
+  struct VMMTree *t = &as->tree;
+  if (size == 0)
+    return NULL;
+  return findOverlapIn(t, t->root, start, start + size);
+}
+
+static bool visitOverlapIn(struct VMMTree *t, struct VMMNode *n, uintptr_t start, uintptr_t end,
+                           bool (*fn)(struct VMMNode *node, void *ctx),
+                           void *ctx) {
+  while (n != &t->nil) {
+    if (n->subtreeMaxEnd <= start || n->subtreeMinStart >= end)
+      return true;
 
-  while (x != &vmmNilNode) {
+    if (!visitOverlapIn(t, n->left, start, end, fn, ctx))
+      return false;
+
+    if (start < n->vaddr + n->size && n->vaddr < end && !fn(n, ctx))
+      return false;
+
+    if (n->vaddr >= end)
+      return true;
+    n = n->right;
+  }
+  return true;
+}
+
+void vmmVisitOverlapping(struct AddressSpace *as, uintptr_t start, size_t size,
+                         bool (*fn)(struct VMMNode *node, void *ctx),
+                         void *ctx) {
+  struct VMMTree *t = &as->tree;
+  if (size == 0 || !fn)
+    return;
+  visitOverlapIn(t, t->root, start, start + size, fn, ctx);
+}
+
+struct VMMNode *vmmNextNode(struct AddressSpace *as, struct VMMNode *node) {
+  struct VMMTree *t = &as->tree;
+  if (node->right != &t->nil)
+    return rbTreeMinimum(t, node->right);
+
+  struct VMMNode *parent = node->parent;
+  while (parent != &t->nil && node == parent->right) {
+    node = parent;
+    parent = parent->parent;
+  }
+  return parent == &t->nil ? NULL : parent;
+}
+
+void vmmInsert(struct AddressSpace *as, struct VMMNode *node) {
+  struct VMMTree *t = &as->tree;
+  struct VMMNode *y = &t->nil;
+  struct VMMNode *x = t->root;
+
+  while (x != &t->nil) {
     y = x;
     if (node->vaddr < x->vaddr)
       x = x->left;
@@ -159,29 +451,38 @@ void vmmInsert(struct VMMNode *node) {
 
   node->parent = y;
 
-  if (y == &vmmNilNode)
-    vmmTree.root = node;
+  if (y == &t->nil)
+    t->root = node;
   else if (node->vaddr < y->vaddr)
     y->left = node;
   else
     y->right = node;
 
-  node->left = &vmmNilNode;
-  node->right = &vmmNilNode;
+  node->left = &t->nil;
+  node->right = &t->nil;
   node->color = VMM_RB_RED;
+  rbUpdatePath(t, node);
 
-  rbInsertFixup(node);
+  rbInsertFixup(t, node);
+  vmmInvalidateLookups(as);
+  indexInsert(as, node);
 }
 
-void vmmDelete(struct VMMNode *z) {
+void vmmDelete(struct AddressSpace *as, struct VMMNode *z) {
+  struct VMMTree *t = &as->tree;
   struct VMMNode *y = z;
   struct VMMNode *x;
+  struct VMMNode *changed = z->parent; // lowest node whose subtree lost z
   enum VMMRBColor y_original_color = y->color;
 
-  if (z->left == &vmmNilNode) {
+  vmmInvalidateLookups(as);
+  if (as->indexValid && z->size > 0)
+    rangeTreeRemove(&as->index, z->vaddr);
+
+  if (z->left == &t->nil) {
     x = z->right;
-    if (z->parent == &vmmNilNode)
-      vmmTree.root = z->right;
+    if (z->parent == &t->nil)
+      t->root = z->right;
     else if (z == z->parent->left)
       z->parent->left = z->right;
     else
@@ -189,10 +490,10 @@ void vmmDelete(struct VMMNode *z) {
 
     z->right->parent = z->parent;
 
-  } else if (z->right == &vmmNilNode) {
+  } else if (z->right == &t->nil) {
     x = z->left;
-    if (z->parent == &vmmNilNode)
-      vmmTree.root = z->left;
+    if (z->parent == &t->nil)
+      t->root = z->left;
     else if (z == z->parent->left)
       z->parent->left = z->left;
     else
@@ -201,13 +502,15 @@ void vmmDelete(struct VMMNode *z) {
     z->left->parent = z->parent;
 
   } else {
-    y = rbTreeMinimum(z->right);
+    y = rbTreeMinimum(t, z->right);
     y_original_color = y->color;
     x = y->right;
 
     if (y->parent == z) {
       x->parent = y;
+      changed = y;
     } else {
+      changed = y->parent;
       if (y == y->parent->left)
         y->parent->left = y->right;
       else
@@ -219,8 +522,8 @@ void vmmDelete(struct VMMNode *z) {
       y->right->parent = y;
     }
 
-    if (z->parent == &vmmNilNode)
-      vmmTree.root = y;
+    if (z->parent == &t->nil)
+      t->root = y;
     else if (z == z->parent->left)
       z->parent->left = y;
     else
@@ -232,11 +535,14 @@ void vmmDelete(struct VMMNode *z) {
     y->color = z->color;
   }
 
+  if (changed != &t->nil)
+    rbUpdatePath(t, changed);
+
   if (y_original_color == VMM_RB_BLACK)
-    rbDeleteFixup(x);
+    rbDeleteFixup(t, x);
 }
 
-static void rbInsertFixup(struct VMMNode *z) {
+static void rbInsertFixup(struct VMMTree *t, struct VMMNode *z) {
   while (z->parent->color == VMM_RB_RED) {
     if (z->parent == z->parent->parent->left) {
       struct VMMNode *y = z->parent->parent->right;
@@ -249,11 +555,11 @@ static void rbInsertFixup(struct VMMNode *z) {
       } else {
         if (z == z->parent->right) {
           z = z->parent;
-          rbRotateLeft(z);
+          rbRotateLeft(t, z);
         }
         z->parent->color = VMM_RB_BLACK;
         z->parent->parent->color = VMM_RB_RED;
-        rbRotateRight(z->parent->parent);
+        rbRotateRight(t, z->parent->parent);
       }
 
     } else {
@@ -267,27 +573,27 @@ static void rbInsertFixup(struct VMMNode *z) {
       } else {
         if (z == z->parent->left) {
           z = z->parent;
-          rbRotateRight(z);
+          rbRotateRight(t, z);
         }
         z->parent->color = VMM_RB_BLACK;
         z->parent->parent->color = VMM_RB_RED;
-        rbRotateLeft(z->parent->parent);
+        rbRotateLeft(t, z->parent->parent);
       }
     }
   }
 
-  vmmTree.root->color = VMM_RB_BLACK;
+  t->root->color = VMM_RB_BLACK;
 }
 
-static void rbDeleteFixup(struct VMMNode *x) {
-  while (x != vmmTree.root && x->color == VMM_RB_BLACK) {
+static void rbDeleteFixup(struct VMMTree *t, struct VMMNode *x) {
+  while (x != t->root && x->color == VMM_RB_BLACK) {
     if (x == x->parent->left) {
       struct VMMNode *w = x->parent->right;
 
       if (w->color == VMM_RB_RED) {
         w->color = VMM_RB_BLACK;
         x->parent->color = VMM_RB_RED;
-        rbRotateLeft(x->parent);
+        rbRotateLeft(t, x->parent);
         w = x->parent->right;
       }
 
@@ -298,14 +604,14 @@ static void rbDeleteFixup(struct VMMNode *x) {
         if (w->right->color == VMM_RB_BLACK) {
           w->left->color = VMM_RB_BLACK;
           w->color = VMM_RB_RED;
-          rbRotateRight(w);
+          rbRotateRight(t, w);
           w = x->parent->right;
         }
         w->color = x->parent->color;
         x->parent->color = VMM_RB_BLACK;
         w->right->color = VMM_RB_BLACK;
-        rbRotateLeft(x->parent);
-        x = vmmTree.root;
+        rbRotateLeft(t, x->parent);
+        x = t->root;
       }
 
     } else {
@@ -314,7 +620,7 @@ static void rbDeleteFixup(struct VMMNode *x) {
       if (w->color == VMM_RB_RED) {
         w->color = VMM_RB_BLACK;
         x->parent->color = VMM_RB_RED;
-        rbRotateRight(x->parent);
+        rbRotateRight(t, x->parent);
         w = x->parent->left;
       }
 
@@ -325,31 +631,31 @@ static void rbDeleteFixup(struct VMMNode *x) {
         if (w->left->color == VMM_RB_BLACK) {
           w->right->color = VMM_RB_BLACK;
           w->color = VMM_RB_RED;
-          rbRotateLeft(w);
+          rbRotateLeft(t, w);
           w = x->parent->left;
         }
         w->color = x->parent->color;
         x->parent->color = VMM_RB_BLACK;
         w->left->color = VMM_RB_BLACK;
-        rbRotateRight(x->parent);
-        x = vmmTree.root;
+        rbRotateRight(t, x->parent);
+        x = t->root;
       }
     }
   }
   x->color = VMM_RB_BLACK;
 }
 
-static void rbRotateLeft(struct VMMNode *x) {
+static void rbRotateLeft(struct VMMTree *t, struct VMMNode *x) {
   struct VMMNode *y = x->right;
   x->right = y->left;
 
-  if (y->left != &vmmNilNode)
+  if (y->left != &t->nil)
     y->left->parent = x;
 
   y->parent = x->parent;
 
-  if (x->parent == &vmmNilNode)
-    vmmTree.root = y;
+  if (x->parent == &t->nil)
+    t->root = y;
   else if (x == x->parent->left)
     x->parent->left = y;
   else
@@ -357,19 +663,22 @@ static void rbRotateLeft(struct VMMNode *x) {
 
   y->left = x;
   x->parent = y;
+
+  rbUpdate(t, x);
+  rbUpdate(t, y);
 }
 
-static void rbRotateRight(struct VMMNode *y) {
+static void rbRotateRight(struct VMMTree *t, struct VMMNode *y) {
   struct VMMNode *x = y->left;
   y->left = x->right;
 
-  if (x->right != &vmmNilNode)
+  if (x->right != &t->nil)
     x->right->parent = y;
 
   x->parent = y->parent;
 
-  if (y->parent == &vmmNilNode)
-    vmmTree.root = x;
+  if (y->parent == &t->nil)
+    t->root = x;
   else if (y == y->parent->right)
     y->parent->right = x;
   else
@@ -377,14 +686,320 @@ static void rbRotateRight(struct VMMNode *y) {
 
   x->right = y;
   y->parent = x;
+
+  rbUpdate(t, y);
+  rbUpdate(t, x);
 }
 
-static struct VMMNode *rbTreeMinimum(struct VMMNode *x) {
-  while (x->left != &vmmNilNode)
+static struct VMMNode *rbTreeMinimum(struct VMMTree *t, struct VMMNode *x) {
+  while (x->left != &t->nil)
     x = x->left;
   return x;
 }
 
+static inline size_t rbGap(uintptr_t from, uintptr_t to) {
+  return to > from ? to - from : 0;
+}
+
+// Recompute a node's augmentation from its children
+static void rbUpdate(struct VMMTree *t, struct VMMNode *n) {
+  if (n == &t->nil)
+    return;
+
+  n->subtreeMinStart = n->vaddr;
+  n->subtreeMaxEnd = n->vaddr + n->size;
+  n->subtreeMaxGap = 0;
+
+  struct VMMNode *l = n->left;
+  if (l != &t->nil) {
+    n->subtreeMinStart = l->subtreeMinStart;
+    if (l->subtreeMaxEnd > n->subtreeMaxEnd)
+      n->subtreeMaxEnd = l->subtreeMaxEnd;
+    n->subtreeMaxGap = l->subtreeMaxGap;
+    size_t gap = rbGap(l->subtreeMaxEnd, n->vaddr);
+    if (gap > n->subtreeMaxGap)
+      n->subtreeMaxGap = gap;
+  }
+
+  struct VMMNode *r = n->right;
+  if (r != &t->nil) {
+    size_t gap = rbGap(n->subtreeMaxEnd, r->subtreeMinStart);
+    if (gap > n->subtreeMaxGap)
+      n->subtreeMaxGap = gap;
+    if (r->subtreeMaxGap > n->subtreeMaxGap)
+      n->subtreeMaxGap = r->subtreeMaxGap;
+    if (r->subtreeMaxEnd > n->subtreeMaxEnd)
+      n->subtreeMaxEnd = r->subtreeMaxEnd;
+  }
+}
+
+static void rbUpdatePath(struct VMMTree *t, struct VMMNode *n) {
+  while (n != &t->nil) {
+    rbUpdate(t, n);
+    n = n->parent;
+  }
+}
+
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Merge & Split
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vmmResizeNode(struct AddressSpace *as, struct VMMNode *node,
+                   uintptr_t vaddr, uintptr_t paddr, size_t size) {
+  if (as->indexValid && node->size > 0)
+    rangeTreeRemove(&as->index, node->vaddr);
+
+  node->vaddr = vaddr;
+  node->paddr = paddr;
+  node->size = size;
+  rbUpdatePath(&as->tree, node);
+  vmmInvalidateLookups(as);
+  indexInsert(as, node);
+}
+
+// b directly follows a, with the same flags and, unless the pages come on
+// demand, the physical range carried on
+static bool nodesMergeable(struct VMMNode *a, struct VMMNode *b) {
+  return a->vaddr + a->size == b->vaddr && a->flags == b->flags &&
+         ((a->flags & VM_LAZY) || a->paddr + a->size == b->paddr);
+}
+
+struct VMMNode *vmmInsertMerge(struct AddressSpace *as, struct VMMNode *node) {
+  struct VMMNode *prev =
+      node->vaddr > 0 ? vmmFindNodeOverlapping(as, node->vaddr - 1, 1) : NULL;
+  struct VMMNode *next =
+      vmmFindNodeOverlapping(as, node->vaddr + node->size, 1);
+
+  if (prev && !nodesMergeable(prev, node))
+    prev = NULL;
+  if (next && !nodesMergeable(node, next))
+    next = NULL;
+
+  if (prev) {
+    size_t size = prev->size + node->size;
+    if (next) {
+      // node fills the hole between two mappings: all three become one
+      size += next->size;
+      vmmDelete(as, next);
+      mempoolFree(&vmmNodePool, next);
+    }
+    vmmResizeNode(as, prev, prev->vaddr, prev->paddr, size);
+    mempoolFree(&vmmNodePool, node);
+    return prev;
+  }
+
+  if (next) {
+    vmmResizeNode(as, next, node->vaddr, node->paddr, node->size + next->size);
+    mempoolFree(&vmmNodePool, node);
+    return next;
+  }
+
+  vmmInsert(as, node);
+  return node;
+}
+
+void *vmmReserve(struct AddressSpace *as, uintptr_t vaddr, size_t size,
+                 uint32_t flags) {
+  if (size == 0)
+    return NULL;
+  size = __alignup(size, PAGE_SIZE);
+
+  spinLock(&as->lock);
+  if (vaddr == 0) {
+    if (as == &kernelAddressSpace)
+      vaddr = vmmFindFreeRange(as, size, PAGE_SIZE, VMM_KERNEL_DYNAMIC_START,
+                               VMM_KERNEL_DYNAMIC_END);
+    else
+      vaddr = vmmFindFreeRange(as, size, PAGE_SIZE, VMM_USER_START,
+                               VMM_USER_END);
+  } else if (vmmFindNodeOverlapping(as, vaddr, size)) {
+    vaddr = 0;
+  }
+
+  struct VMMNode *node = vaddr ? mempoolAlloc(&vmmNodePool) : NULL;
+  if (!node) {
+    spinUnlock(&as->lock);
+    return NULL;
+  }
+
+  node->vaddr = vaddr;
+  node->paddr = 0;
+  node->size = size;
+  node->flags = flags | VM_LAZY | VM_ANON;
+  vmmInsertMerge(as, node);
+  spinUnlock(&as->lock);
+
+  return (void *)vaddr;
+}
+
+struct VMMNode *vmmSplitNode(struct AddressSpace *as, struct VMMNode *node,
+                             uintptr_t at) {
+  if (at <= node->vaddr || at >= node->vaddr + node->size)
+    return NULL;
+
+  struct VMMNode *tail = mempoolAlloc(&vmmNodePool);
+  if (!tail)
+    return NULL;
+
+  size_t headSize = at - node->vaddr;
+  tail->vaddr = at;
+  tail->paddr = (node->flags & VM_LAZY) ? 0 : node->paddr + headSize;
+  tail->size = node->size - headSize;
+  tail->flags = node->flags;
+
+  vmmResizeNode(as, node, node->vaddr, node->paddr, headSize);
+  vmmInsert(as, tail);
+  return tail;
+}
+
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Free Range Search
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Fit size bytes into the hole [from, to) clipped to [lo, hi); 0 if it doesn't fit
+static uintptr_t fitHole(uintptr_t from, uintptr_t to, size_t size,
+                         size_t align, uintptr_t lo, uintptr_t hi) {
+  if (from < lo)
+    from = lo;
+  if (to > hi)
+    to = hi;
+
+  uintptr_t start = __alignup(from, align);
+  if (start < from || start >= to || to - start < size)
+    return 0;
+  return start;
+}
+
+// Lowest fit in the subtree at n, which owns the address span [prevEnd, nextStart)
+static uintptr_t findFreeIn(struct VMMTree *t, struct VMMNode *n, uintptr_t prevEnd,
+                            uintptr_t nextStart, size_t size, size_t align,
+                            uintptr_t lo, uintptr_t hi) {
+  if (nextStart <= lo || prevEnd >= hi)
+    return 0;
+
+  if (n == &t->nil)
+    return fitHole(prevEnd, nextStart, size, align, lo, hi);
+
+  // the holes of this span: before the subtree, inside it and after it
+  if (rbGap(prevEnd, n->subtreeMinStart) < size && n->subtreeMaxGap < size &&
+      rbGap(n->subtreeMaxEnd, nextStart) < size)
+    return 0;
+
+  uintptr_t found =
+      findFreeIn(t, n->left, prevEnd, n->vaddr, size, align, lo, hi);
+  if (found)
+    return found;
+
+  return findFreeIn(t, n->right, n->vaddr + n->size, nextStart, size, align, lo,
+                    hi);
+}
+
+uintptr_t vmmFindFreeRange(struct AddressSpace *as, size_t size, size_t align,
+                           uintptr_t lo, uintptr_t hi) {
+  struct VMMTree *t = &as->tree;
+  if (size == 0 || lo >= hi)
+    return 0;
+  if (align < PAGE_SIZE)
+    align = PAGE_SIZE;
+  size = __alignup(size, PAGE_SIZE);
+
+  return findFreeIn(t, t->root, 0, UINTPTR_MAX, size, align, lo, hi);
+}
+
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lookup Benchmark
+// ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vmmBenchLookup(size_t mappings, size_t lookups) {
+  struct AddressSpace *as = &kernelAddressSpace;
+  spinLock(&as->lock);
+  if (!as->indexValid) {
+    spinUnlock(&as->lock);
+    printfError("vmm: bench: range index is disabled\n");
+    return;
+  }
+
+  // one page mapped, one page hole, repeated; nothing backs these nodes
+  size_t span = mappings * 2 * SIZE_4KB;
+  uintptr_t base = VMM_KERNEL_DYNAMIC_END - span;
+  if (mappings == 0 || vmmFindNodeOverlapping(as, base, span)) {
+    spinUnlock(&as->lock);
+    printfError("vmm: bench: no room for %lu mappings\n", mappings);
+    return;
+  }
+
+  struct VMMNode **nodes = kmalloc(mappings * sizeof(*nodes));
+  if (!nodes) {
+    spinUnlock(&as->lock);
+    return;
+  }
+
+  size_t made = 0;
+  for (; made < mappings; ++made) {
+    struct VMMNode *node = slubCacheAlloc(vmmNodeCache);
+    if (!node)
+      break;
+    node->vaddr = base + made * 2 * SIZE_4KB;
+    node->paddr = 0;
+    node->size = SIZE_4KB;
+    node->flags = 0;
+    vmmInsert(as, node);
+    nodes[made] = node;
+  }
+  if (made == 0) {
+    spinUnlock(&as->lock);
+    kfree(nodes);
+    return;
+  }
+
+  // both passes look up the same pseudo-random addresses
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  size_t treeHits = 0, indexHits = 0;
+
+  uint64_t start = archCycleCounter();
+  for (size_t i = 0; i < lookups; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    uintptr_t addr = base + ((seed >> 33) % (made * 2)) * SIZE_4KB;
+    treeHits += rbFindContaining(&as->tree, addr) != NULL;
+  }
+  uint64_t treeCycles = archCycleCounter() - start;
+
+  seed = 0x9E3779B97F4A7C15ULL;
+  start = archCycleCounter();
+  for (size_t i = 0; i < lookups; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    uintptr_t addr = base + ((seed >> 33) % (made * 2)) * SIZE_4KB;
+    indexHits += rangeTreeLookup(&as->index, addr) != NULL;
+  }
+  uint64_t indexCycles = archCycleCounter() - start;
+
+  // a fault-like pattern: several touches per page, walking up the range
+  start = archCycleCounter();
+  for (size_t i = 0; i < lookups; ++i) {
+    uintptr_t addr = base + ((i / 8) % (made * 2)) * SIZE_4KB + (i % 8) * 64;
+    vmmFindNodeContaining(as, addr);
+  }
+  uint64_t cachedCycles = archCycleCounter() - start;
+
+  for (size_t i = 0; i < made; ++i) {
+    vmmDelete(as, nodes[i]);
+    slubCacheFree(vmmNodeCache, nodes[i]);
+  }
+  spinUnlock(&as->lock);
+  kfree(nodes);
+
+  if (treeHits != indexHits)
+    printfError("vmm: bench: tree found %lu, index found %lu\n", treeHits,
+                indexHits);
+
+  size_t ops = lookups ? lookups : 1;
+  printfInfo("vmm: bench %lu lookups over %lu mappings: rb-tree %lu "
+             "cycles/lookup, range index %lu cycles/lookup, sequential with "
+             "lookup cache %lu cycles/lookup\n",
+             lookups, made, treeCycles / ops, indexCycles / ops,
+             cachedCycles / ops);
+}
+
 // ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Memory Mapping
 // ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -403,6 +1018,7 @@ __init static void mapMemories() {
 
   // ALLOCATOR
   pmmMap();
+  hugePoolMap();
 
   // KERNEL
   uintptr_t kernelStart = __aligndown((uintptr_t)&__kernelStart, ALIGN_4KB);
@@ -1,2 +1,230 @@
+#include <macros.h>
+#include <mm/hhdm.h>
+#include <mm/hugepage.h>
+#include <mm/mempool.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/zone.h>
+#include <printf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdmem.h>
 #include <syscall/mmap.h>
 
+static uint32_t protToVmFlags(int prot) {
+  uint32_t flags = 0;
+  if (prot & PROT_READ)
+    flags |= VM_READ;
+  if (prot & PROT_WRITE)
+    flags |= VM_WRITE;
+  if (prot & PROT_EXEC)
+    flags |= VM_EXEC;
+  return flags;
+}
+
+// Page aligned and inside the user half
+static bool userRangeValid(uintptr_t start, size_t size) {
+  return (start & (PAGE_SIZE - 1)) == 0 && size > 0 &&
+         start >= VMM_USER_START && start < VMM_USER_END &&
+         size <= VMM_USER_END - start;
+}
+
+// Make at a page boundary in the page tables; huge pages can't be cut.
+// Changes no node, so a caller can still give up afterwards
+static bool breakAt(struct AddressSpace *as, uintptr_t at) {
+  struct VMMNode *node = vmmFindNodeContaining(as, at);
+  if (!node || node->vaddr == at)
+    return true;
+  if (at & (vmmPageSize(node->flags) - 1))
+    return false;
+  return vmmBreakLargePages(as, at, node->flags);
+}
+
+// Make at a node boundary; breakAt() must have succeeded first
+static bool splitAt(struct AddressSpace *as, uintptr_t at) {
+  struct VMMNode *node = vmmFindNodeContaining(as, at);
+  if (!node || node->vaddr == at)
+    return true;
+  return vmmSplitNode(as, node, at) != NULL;
+}
+
+static int unmapLocked(struct AddressSpace *as, uintptr_t start, size_t size) {
+  uintptr_t end = start + size;
+
+  // refuse before anything is changed
+  for (struct VMMNode *node = vmmFindNodeOverlapping(as, start, size);
+       node && node->vaddr < end; node = vmmNextNode(as, node)) {
+    if (node->flags & VM_PERMANENT)
+      return -1;
+  }
+
+  if (!breakAt(as, start) || !breakAt(as, end) || !splitAt(as, start) ||
+      !splitAt(as, end))
+    return -1;
+
+  struct VMMNode *node;
+  while ((node = vmmFindNodeOverlapping(as, start, size))) {
+    vmmUnmapPages(as, node->vaddr, node->size, node->flags);
+    vmmDelete(as, node);
+    mempoolFree(&vmmNodePool, node);
+  }
+  return 0;
+}
+
+static bool populate(struct AddressSpace *as, uintptr_t start, size_t size,
+                     uint32_t flags) {
+  size_t pageSize = vmmPageSize(flags);
+  int level = pageSize == SIZE_1GB ? 2 : pageSize == SIZE_2MB ? 1 : 0;
+
+  for (uintptr_t vaddr = start; vaddr < start + size; vaddr += pageSize) {
+    void *paddr = (flags & VM_HUGE) ? hugePageAlloc(pageSize)
+                                    : pageAlloc(ZONE_NORMAL, 1);
+    if (!paddr)
+      return false;
+    memset(hhdmAdd(paddr), 0, pageSize);
+
+    if (!vmmMapPage(as, vaddr, (uintptr_t)paddr, level, flags)) {
+      vmmFramePut(paddr, flags);
+      return false;
+    }
+  }
+  return true;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           uintptr_t offset) {
+  (void)fd;
+  (void)offset;
+
+  bool isShared = flags & MAP_SHARED, isPrivate = flags & MAP_PRIVATE;
+  if (!(flags & MAP_ANONYMOUS) || isShared == isPrivate || length == 0)
+    return MAP_FAILED;
+  if ((flags & MAP_HUGE_2MB) && (flags & MAP_HUGE_1GB))
+    return MAP_FAILED;
+
+  // huge mappings take their pages from the pool up front, so they can't
+  // fail later; everything else is backed on first touch
+  uint32_t vmFlags = protToVmFlags(prot) | VM_USER | VM_ANON;
+  if (flags & MAP_HUGE_1GB)
+    vmFlags |= VM_HUGE_1GB;
+  else if (flags & MAP_HUGE_2MB)
+    vmFlags |= VM_HUGE_2MB;
+  else
+    vmFlags |= VM_LAZY;
+  if (isPrivate)
+    vmFlags |= VM_PRIVATE;
+
+  struct AddressSpace *as = addressSpaceCurrent();
+  size_t pageSize = vmmPageSize(vmFlags);
+  uintptr_t start = (uintptr_t)addr;
+  size_t size = __alignup(length, pageSize);
+  bool fixed = flags & (MAP_FIXED | MAP_FIXED_NOREPLACE);
+  if (fixed && (!userRangeValid(start, size) || (start & (pageSize - 1))))
+    return MAP_FAILED;
+  if ((vmFlags & VM_HUGE) && hugePoolAvailable(pageSize) < size / pageSize)
+    return MAP_FAILED;
+
+  // Take the node first so running out of memory can't leave the old
+  // mapping of a MAP_FIXED range already torn down
+  struct VMMNode *node = mempoolAlloc(&vmmNodePool);
+  if (!node)
+    return MAP_FAILED;
+
+  spinLock(&as->lock);
+  if (flags & MAP_FIXED_NOREPLACE) {
+    if (vmmFindNodeOverlapping(as, start, size))
+      goto fail;
+  } else if (flags & MAP_FIXED) {
+    if (unmapLocked(as, start, size) != 0)
+      goto fail;
+  } else {
+    // the hint is taken if it is free, otherwise the lowest hole fits
+    start = __aligndown(start, pageSize);
+    if (!userRangeValid(start, size) ||
+        vmmFindNodeOverlapping(as, start, size))
+      start = vmmFindFreeRange(as, size, pageSize, VMM_USER_START,
+                               VMM_USER_END);
+    if (!start)
+      goto fail;
+  }
+
+  node->vaddr = start;
+  node->paddr = 0;
+  node->size = size;
+  node->flags = vmFlags;
+  vmmInsertMerge(as, node);
+
+  bool eager = (vmFlags & VM_HUGE) ||
+               ((flags & MAP_POPULATE) && (vmFlags & VM_PROT_MASK));
+  if (eager && !populate(as, start, size, vmFlags)) {
+    unmapLocked(as, start, size);
+    spinUnlock(&as->lock);
+    printfError("mmap: out of memory populating 0x%lx bytes\n", size);
+    return MAP_FAILED;
+  }
+
+  spinUnlock(&as->lock);
+  return (void *)start;
+
+fail:
+  spinUnlock(&as->lock);
+  mempoolFree(&vmmNodePool, node);
+  return MAP_FAILED;
+}
+
+int munmap(void *addr, size_t length) {
+  uintptr_t start = (uintptr_t)addr;
+  size_t size = __alignup(length, PAGE_SIZE);
+  if (!userRangeValid(start, size))
+    return -1;
+
+  struct AddressSpace *as = addressSpaceCurrent();
+  spinLock(&as->lock);
+  int ret = unmapLocked(as, start, size);
+  spinUnlock(&as->lock);
+  return ret;
+}
+
+int mprotect(void *addr, size_t length, int prot) {
+  uintptr_t start = (uintptr_t)addr;
+  size_t size = __alignup(length, PAGE_SIZE);
+  if (!userRangeValid(start, size))
+    return -1;
+
+  uintptr_t end = start + size;
+  uint32_t protFlags = protToVmFlags(prot);
+  struct AddressSpace *as = addressSpaceCurrent();
+  spinLock(&as->lock);
+
+  // every page has to be mapped
+  uintptr_t covered = start;
+  for (struct VMMNode *node = vmmFindNodeOverlapping(as, start, size);
+       node && node->vaddr < end; node = vmmNextNode(as, node)) {
+    if (node->vaddr > covered || (node->flags & VM_PERMANENT))
+      break;
+    covered = node->vaddr + node->size;
+  }
+  if (covered < end || !breakAt(as, start) || !breakAt(as, end) ||
+      !splitAt(as, start) || !splitAt(as, end)) {
+    spinUnlock(&as->lock);
+    return -1;
+  }
+
+  struct VMMNode *first = vmmFindNodeContaining(as, start);
+  for (struct VMMNode *node = first; node && node->vaddr < end;
+       node = vmmNextNode(as, node)) {
+    node->flags = (node->flags & ~VM_PROT_MASK) | protFlags;
+    vmmProtectPages(as, node->vaddr, node->size, node->flags);
+  }
+
+  // fold the pieces back together, and into neighbours with the same
+  // protection; a node's successor after merging is the next one to visit
+  struct VMMNode *node = first;
+  while (node && node->vaddr <= end) {
+    vmmDelete(as, node);
+    node = vmmNextNode(as, vmmInsertMerge(as, node));
+  }
+
+  spinUnlock(&as->lock);
+  return 0;
+}
\ No newline at end of file
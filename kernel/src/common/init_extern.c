@@ -6,8 +6,9 @@
 #include <stack.h>
 #include <stdint.h>
 
-struct VMMTree vmmTree = {0};
-struct VMMNode vmmNilNode = {0};
+struct AddressSpace kernelAddressSpace = {0};
+struct SlubCache *vmmNodeCache = NULL;
+struct Mempool vmmNodePool = {0};
 struct MemoryMap memmap = {0};
 uintptr_t stackAddress = 0;
 uintptr_t hhdmOffset = 0;
@@ -15,4 +16,5 @@ uintptr_t kernelPhysAddr = 0;
 uintptr_t kernelVirtAddr = 0;
 uint32_t cpuID0 = 0;
 uint32_t cpuCount = 1;
-uint32_t *cpuIDs = &cpuID0;
\ No newline at end of file
+uint32_t *cpuIDs = &cpuID0;
+volatile uint64_t cpuOnlineMask = 0;
\ No newline at end of file
@@ -214,6 +214,32 @@ void buddyFree(struct Zone *zone, void *vaddr) {
     b->freePages += (1ULL << currentOrder);
 }
 
+/* physical base of the block (free or allocated) that contains phys; 0 if outside this buddy */
+uintptr_t buddyBlockBase(struct Zone *zone, uintptr_t phys) {
+    if (!zone || !zone->buddy) return 0;
+    struct Buddy *b = zone->buddy;
+
+    if (phys < b->base || phys >= b->base + b->length) return 0;
+
+    size_t pageIndex = physToPageIndex(b, phys);
+    uint8_t order = b->pageOrders[pageIndex];
+    if (order >= BUDDY_MAX_ORDER) return 0;
+
+    /* blocks are aligned to their size relative to b->base */
+    return buddyBlockPhys(b, pageIndex & ~((1ULL << order) - 1));
+}
+
+size_t buddyBlockPages(struct Zone *zone, uintptr_t phys) {
+    if (!zone || !zone->buddy) return 0;
+    struct Buddy *b = zone->buddy;
+
+    if (phys < b->base || phys >= b->base + b->length) return 0;
+
+    uint8_t order = b->pageOrders[physToPageIndex(b, phys)];
+    if (order >= BUDDY_MAX_ORDER) return 0;
+    return (size_t)1 << order;
+}
+
 void buddyDump(struct Buddy *b) {
     if (!b) {
         printf("Buddy = NULL\n");
@@ -0,0 +1,201 @@
+#include <macros.h>
+#include <mm/hhdm.h>
+#include <mm/hugepage.h>
+#include <mm/kmap.h>
+#include <mm/memmap.h>
+#include <mm/pmm.h>
+#include <mm/zone.h>
+#include <printf.h>
+#include <spinlock.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdmem.h>
+
+struct HugePage {
+  uintptr_t paddr;
+  uint32_t refs; // 0 while the page sits in the pool
+};
+
+struct HugePool {
+  struct HugePage *pages;
+  size_t total;
+  size_t free;
+  size_t pageSize;
+  struct Spinlock lock;
+};
+
+// keep the arrays non-empty when a pool is configured away
+static struct HugePage pages2mb[HUGEPAGE_POOL_2MB > 0 ? HUGEPAGE_POOL_2MB : 1];
+static struct HugePage pages1gb[HUGEPAGE_POOL_1GB > 0 ? HUGEPAGE_POOL_1GB : 1];
+
+static struct HugePool pool2mb = {.pages = pages2mb, .pageSize = SIZE_2MB};
+static struct HugePool pool1gb = {.pages = pages1gb, .pageSize = SIZE_1GB};
+
+static inline struct HugePool *poolFor(size_t size) {
+  if (size == SIZE_2MB)
+    return &pool2mb;
+  if (size == SIZE_1GB)
+    return &pool1gb;
+  return NULL;
+}
+
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Init
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+__init void hugePoolCarve() {
+  struct MemoryEntries *usable = memmap.usable;
+  struct HugePool *pool = &pool1gb;
+  size_t target = HUGEPAGE_POOL_1GB;
+
+  size_t i = 0;
+  while (i < usable->count && pool->total < target) {
+    struct MemoryMapEntry *e = &usable->entries[i];
+    uintptr_t end = e->base + e->length;
+    uintptr_t chunk = __alignup(e->base, SIZE_1GB);
+    if (chunk < e->base || chunk + SIZE_1GB > end) {
+      i++;
+      continue;
+    }
+
+    bool head = chunk > e->base, tail = chunk + SIZE_1GB < end;
+    if (head && tail) {
+      // the entry splits in two around the chunk; the list stays sorted
+      if (usable->count >= usable->capacity) {
+        i++;
+        continue;
+      }
+      memmove(&usable->entries[i + 2], &usable->entries[i + 1],
+              (usable->count - i - 1) * sizeof(*e));
+      usable->count++;
+      usable->entries[i + 1].base = chunk + SIZE_1GB;
+      usable->entries[i + 1].length = end - (chunk + SIZE_1GB);
+      e->length = chunk - e->base;
+    } else if (head) {
+      e->length = chunk - e->base;
+    } else if (tail) {
+      e->base = chunk + SIZE_1GB;
+      e->length = end - e->base;
+    } else {
+      memmove(e, e + 1, (usable->count - i - 1) * sizeof(*e));
+      usable->count--;
+    }
+
+    // what is left of entry i may hold another chunk, so look again
+    pool->pages[pool->total].paddr = chunk;
+    pool->pages[pool->total].refs = 0;
+    pool->total++;
+  }
+
+  pool->free = pool->total;
+  if (pool->total < target)
+    printfError("hugepage: only %lu of %lu 1 GiB pages reserved\n",
+                pool->total, target);
+}
+
+__init void hugePoolInit() {
+  struct HugePool *pool = &pool2mb;
+  size_t target = HUGEPAGE_POOL_2MB;
+
+  while (pool->total < target) {
+    void *page =
+        pageAllocAligned(ZONE_NORMAL, SIZE_2MB / PAGE_SIZE, SIZE_2MB);
+    if (!page)
+      break;
+    pool->pages[pool->total].paddr = (uintptr_t)page;
+    pool->pages[pool->total].refs = 0;
+    pool->total++;
+  }
+
+  pool->free = pool->total;
+  if (pool->total < target)
+    printfError("hugepage: only %lu of %lu 2 MiB pages reserved\n",
+                pool->total, target);
+  printfInfo("hugepage: %lu x 2 MiB, %lu x 1 GiB reserved\n", pool2mb.total,
+             pool1gb.total);
+}
+
+__init void hugePoolMap() {
+  for (size_t i = 0; i < pool1gb.total; ++i) {
+    uintptr_t paddr = pool1gb.pages[i].paddr;
+    kmap(paddr, hhdmAddAddr(paddr), SIZE_1GB);
+  }
+}
+
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Core
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void *hugePageAlloc(size_t size) {
+  struct HugePool *pool = poolFor(size);
+  if (!pool)
+    return NULL;
+
+  void *paddr = NULL;
+  spinLock(&pool->lock);
+  for (size_t i = 0; pool->free > 0 && i < pool->total; ++i) {
+    if (pool->pages[i].refs == 0) {
+      pool->pages[i].refs = 1;
+      pool->free--;
+      paddr = (void *)pool->pages[i].paddr;
+      break;
+    }
+  }
+  spinUnlock(&pool->lock);
+  return paddr;
+}
+
+// Pool entry of paddr, with its pool locked
+static struct HugePage *findLocked(void *paddr, struct HugePool **poolOut) {
+  struct HugePool *pools[] = {&pool2mb, &pool1gb};
+
+  for (size_t p = 0; p < 2; ++p) {
+    struct HugePool *pool = pools[p];
+    spinLock(&pool->lock);
+    for (size_t i = 0; i < pool->total; ++i) {
+      if (pool->pages[i].paddr == (uintptr_t)paddr) {
+        *poolOut = pool;
+        return &pool->pages[i];
+      }
+    }
+    spinUnlock(&pool->lock);
+  }
+  return NULL;
+}
+
+void hugePageGet(void *paddr) {
+  struct HugePool *pool;
+  struct HugePage *page = findLocked(paddr, &pool);
+  if (!page)
+    return;
+  page->refs++;
+  spinUnlock(&pool->lock);
+}
+
+bool hugePagePut(void *paddr) {
+  struct HugePool *pool;
+  struct HugePage *page = findLocked(paddr, &pool);
+  if (!page)
+    return false;
+
+  bool released = page->refs > 0 && --page->refs == 0;
+  if (released)
+    pool->free++;
+  spinUnlock(&pool->lock);
+  return released;
+}
+
+size_t hugePageRefCount(void *paddr) {
+  struct HugePool *pool;
+  struct HugePage *page = findLocked(paddr, &pool);
+  if (!page)
+    return 0;
+  size_t refs = page->refs;
+  spinUnlock(&pool->lock);
+  return refs;
+}
+
+size_t hugePoolAvailable(size_t size) {
+  struct HugePool *pool = poolFor(size);
+  return pool ? pool->free : 0;
+}
\ No newline at end of file
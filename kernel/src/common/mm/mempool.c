@@ -0,0 +1,152 @@
+#include <mm/hhdm.h>
+#include <mm/mempool.h>
+#include <mm/pmm.h>
+#include <mm/slub.h>
+#include <mm/zone.h>
+#include <printf.h>
+#include <spinlock.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static void *mempoolBackendAlloc(struct Mempool *pool) {
+  switch (pool->kind) {
+  case MEMPOOL_CACHE:
+    return slubCacheAlloc(pool->cache);
+  case MEMPOOL_SIZE:
+    return kmalloc(pool->size);
+  case MEMPOOL_PAGES: {
+    void *paddr = pageAlloc(ZONE_NORMAL, pool->size);
+    return paddr ? hhdmAdd(paddr) : NULL;
+  }
+  }
+  return NULL;
+}
+
+static void mempoolBackendFree(struct Mempool *pool, void *element) {
+  switch (pool->kind) {
+  case MEMPOOL_CACHE:
+    slubCacheFree(pool->cache, element);
+    break;
+  case MEMPOOL_SIZE:
+    kfreeSized(element, pool->size);
+    break;
+  case MEMPOOL_PAGES:
+    pageFree(hhdmRemove(element));
+    break;
+  }
+}
+
+static bool mempoolInit(struct Mempool *pool, enum MempoolKind kind,
+                        size_t minReserved, struct SlubCache *cache,
+                        size_t size) {
+  pool->kind = kind;
+  pool->cache = cache;
+  pool->size = size;
+  pool->minReserved = minReserved;
+  pool->reserved = 0;
+  pool->elements = NULL;
+  spinInit(&pool->lock);
+
+  if (minReserved == 0)
+    return true;
+
+  pool->elements = kmalloc(minReserved * sizeof(void *));
+  if (!pool->elements) {
+    printfError("mempool: cannot allocate a %lu element reserve\n",
+                minReserved);
+    return false;
+  }
+
+  return mempoolRefill(pool);
+}
+
+bool mempoolInitCache(struct Mempool *pool, size_t minReserved,
+                      struct SlubCache *cache) {
+  if (!cache)
+    return false;
+  return mempoolInit(pool, MEMPOOL_CACHE, minReserved, cache, 0);
+}
+
+bool mempoolInitSize(struct Mempool *pool, size_t minReserved, size_t size) {
+  return mempoolInit(pool, MEMPOOL_SIZE, minReserved, NULL, size);
+}
+
+bool mempoolInitPages(struct Mempool *pool, size_t minReserved,
+                      size_t pageCount) {
+  return mempoolInit(pool, MEMPOOL_PAGES, minReserved, NULL, pageCount);
+}
+
+bool mempoolRefill(struct Mempool *pool) {
+  for (;;) {
+    spinLock(&pool->lock);
+    bool full = pool->reserved >= pool->minReserved;
+    spinUnlock(&pool->lock);
+    if (full)
+      return true;
+
+    // allocate outside the lock, the backend may take its own locks
+    void *element = mempoolBackendAlloc(pool);
+    if (!element)
+      return false;
+
+    spinLock(&pool->lock);
+    if (pool->reserved < pool->minReserved) {
+      pool->elements[pool->reserved++] = element;
+      element = NULL;
+    }
+    spinUnlock(&pool->lock);
+
+    // someone else filled the last slot meanwhile
+    if (element) {
+      mempoolBackendFree(pool, element);
+      return true;
+    }
+  }
+}
+
+void *mempoolAlloc(struct Mempool *pool) {
+  void *element = mempoolBackendAlloc(pool);
+  if (element) {
+    // memory is back: opportunistically replace one element we handed out
+    spinLock(&pool->lock);
+    bool low = pool->reserved < pool->minReserved;
+    spinUnlock(&pool->lock);
+    if (low) {
+      void *spare = mempoolBackendAlloc(pool);
+      if (spare)
+        mempoolFree(pool, spare);
+    }
+    return element;
+  }
+
+  spinLock(&pool->lock);
+  if (pool->reserved > 0)
+    element = pool->elements[--pool->reserved];
+  size_t left = pool->reserved;
+  spinUnlock(&pool->lock);
+
+#ifndef NDEBUG
+  if (element) {
+    printfDebug("mempool: allocator failed, served from reserve (%lu left)\n",
+                left);
+  }
+#else
+  (void)left;
+#endif
+  return element;
+}
+
+void mempoolFree(struct Mempool *pool, void *element) {
+  if (!element)
+    return;
+
+  spinLock(&pool->lock);
+  if (pool->reserved < pool->minReserved) {
+    pool->elements[pool->reserved++] = element;
+    element = NULL;
+  }
+  spinUnlock(&pool->lock);
+
+  if (element)
+    mempoolBackendFree(pool, element);
+}
\ No newline at end of file
@@ -76,6 +76,8 @@ __init void pmmInit() {
 
     size_t metaSize = sizeof(struct Buddy);
     metaSize += (z->length / PAGE_SIZE); // pageOrders array
+    metaSize = __alignup(metaSize, sizeof(uint32_t));
+    metaSize += (z->length / PAGE_SIZE) * sizeof(uint32_t); // pageRefs array
 
     struct MemoryMapEntry *entry = findSmallestUsableEntry(metaSize);
     if (!entry) {
@@ -120,8 +122,10 @@ __init void pmmMap() {
     }
 
     if (b->pageOrders) {
-      size_t pageOrdersSize = b->totalPages * sizeof(uint8_t);
-      size_t pagesToMap = __alignup(pageOrdersSize, PAGE_SIZE) / PAGE_SIZE;
+      // pageOrders and pageRefs sit back to back
+      uintptr_t metaEnd = (uintptr_t)(b->pageRefs + b->totalPages);
+      size_t pagesToMap =
+          __alignup(metaEnd - pageOrdersAligned, PAGE_SIZE) / PAGE_SIZE;
 
       kmap(hhdmRemoveAddr((uintptr_t)pageOrdersAligned),
            (uintptr_t)pageOrdersAligned, pagesToMap * SIZE_4KB);
@@ -188,6 +192,8 @@ static void initBuddyForZone(struct Zone *z) {
       b->length = 0;
       b->totalPages = 0;
       b->freePages = 0;
+      b->pageOrders = NULL;
+      b->pageRefs = NULL;
 
       memset(b->freeLists, 0, sizeof(b->freeLists));
       return; // buddy allocator is empty but doesn't crash
@@ -211,6 +217,11 @@ static void initBuddyForZone(struct Zone *z) {
   b->pageOrders = (uint8_t *)((uintptr_t)b + sizeof(struct Buddy));
   memset(b->pageOrders, BUDDY_MAX_ORDER - 1, b->totalPages);
 
+  // pageRefs array, laid out as pmmInit() sized it
+  b->pageRefs = (uint32_t *)__alignup(
+      (uintptr_t)b->pageOrders + z->length / PAGE_SIZE, sizeof(uint32_t));
+  memset(b->pageRefs, 0, b->totalPages * sizeof(uint32_t));
+
   // insert one big block (at the buddy base, not at z->base which may not be
   // aligned)
   struct FreeBlock *blk = (struct FreeBlock *)hhdmAdd((void *)(b->base));
@@ -269,6 +280,69 @@ void pageFree(void *addr) {
   buddyFree(z, addr);
 }
 
+/* Reference counter of the page at addr, NULL if no buddy manages it. */
+static uint32_t *pageRefSlot(void *addr) {
+  struct Zone *z = findZoneByAddress((uintptr_t)addr);
+  if (!z || !z->buddy || !z->buddy->pageRefs)
+    return NULL;
+
+  struct Buddy *b = z->buddy;
+  uintptr_t a = (uintptr_t)addr;
+  if (a < b->base || a >= b->base + b->length)
+    return NULL;
+  return &b->pageRefs[(a - b->base) / PAGE_SIZE];
+}
+
+void pageGet(void *addr) {
+  uint32_t *refs = pageRefSlot(addr);
+  if (refs)
+    __atomic_fetch_add(refs, 1, __ATOMIC_RELAXED);
+}
+
+bool pagePut(void *addr) {
+  uint32_t *refs = pageRefSlot(addr);
+  if (refs && __atomic_load_n(refs, __ATOMIC_ACQUIRE) > 0) {
+    // drop an extra reference; if the count hit 0 underneath us, this was
+    // the last one after all
+    if (__atomic_fetch_sub(refs, 1, __ATOMIC_ACQ_REL) > 0)
+      return false;
+    __atomic_store_n(refs, 0, __ATOMIC_RELAXED);
+  }
+
+  pageFree(addr);
+  return true;
+}
+
+size_t pageRefCount(void *addr) {
+  uint32_t *refs = pageRefSlot(addr);
+  return refs ? __atomic_load_n(refs, __ATOMIC_ACQUIRE) + 1 : 1;
+}
+
+/* Physical base of the pageAlloc() block that contains addr, so a pointer into
+ * the middle of a multi-page allocation can find its first page. */
+void *pageBlockBase(void *addr) {
+  if (!addr)
+    return NULL;
+
+  struct Zone *z = findZoneByAddress((uintptr_t)addr);
+  if (!z)
+    return NULL;
+
+  return (void *)buddyBlockBase(z, (uintptr_t)addr);
+}
+
+/* Size in pages of the pageAlloc() block that contains addr, 0 if unknown. */
+size_t pageBlockPages(void *addr) {
+  if (!addr)
+    return 0;
+
+  struct Zone *z = findZoneByAddress((uintptr_t)addr);
+  if (!z)
+    return 0;
+
+  return buddyBlockPages(z, (uintptr_t)addr);
+}
+
 // ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Zone Finder
 // ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -334,17 +408,19 @@ static inline struct Zone *findZoneByAddress(uintptr_t addr) {
       addr < lastZoneByAddr->base + lastZoneByAddr->length)
     return lastZoneByAddr;
 
-  size_t low = 0, high = zoneCount - 1;
-  while (low <= high) {
+  size_t low = 0, high = zoneCount;
+  while (low < high) {
     size_t mid = (low + high) / 2;
     struct Zone *z = &zones[mid];
 
     if (addr < z->base)
-      high = mid - 1;
+      high = mid;
     else if (addr >= z->base + z->length)
       low = mid + 1;
-    else
+    else {
+      lastZoneByAddr = z;
       return z; // Found zone
+    }
   }
   return NULL;
 }
@@ -0,0 +1,327 @@
+#include <mm/mempool.h>
+#include <mm/range_tree.h>
+#include <mm/slub.h>
+#include <printf.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdmem.h>
+
+/*
+ * Keys are range starts. An inner node's child[i] holds keys in
+ * [pivot[i - 1], pivot[i]). Removing a range leaves pivots alone and only
+ * drops nodes once they are empty, so a pivot may sit below the first key of
+ * its child; lookups account for that by falling back to the predecessor
+ * subtree.
+ */
+
+#define RANGE_TREE_MAX_HEIGHT 16
+
+static struct SlubCache *rangeTreeNodeCache = NULL;
+static struct Mempool rangeTreeNodePool;
+
+bool rangeTreeSetup() {
+  if (rangeTreeNodeCache)
+    return true;
+
+  rangeTreeNodeCache = slubCacheCreate(
+      "range-tree-node", sizeof(struct RangeTreeNode), 64, NULL);
+  if (!rangeTreeNodeCache)
+    return false;
+
+  return mempoolInitCache(&rangeTreeNodePool, RANGE_TREE_NODE_RESERVE,
+                          rangeTreeNodeCache);
+}
+
+void rangeTreeInit(struct RangeTree *tree) {
+  tree->root = NULL;
+  tree->height = 0;
+  tree->count = 0;
+}
+
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Node Helpers
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Child slot of an inner node that key belongs to
+static inline size_t childIndex(struct RangeTreeNode *node, uintptr_t key) {
+  size_t k = 0;
+  while (k + 1 < node->count && node->i.pivot[k] <= key)
+    k++;
+  return k;
+}
+
+static void leafInsertAt(struct RangeTreeNode *leaf, size_t pos,
+                         uintptr_t start, uintptr_t end, void *value) {
+  for (size_t j = leaf->count; j > pos; --j) {
+    leaf->l.start[j] = leaf->l.start[j - 1];
+    leaf->l.end[j] = leaf->l.end[j - 1];
+    leaf->l.value[j] = leaf->l.value[j - 1];
+  }
+  leaf->l.start[pos] = start;
+  leaf->l.end[pos] = end;
+  leaf->l.value[pos] = value;
+  leaf->count++;
+}
+
+// Place child at slot pos (>= 1), separated from its left neighbour by pivot
+static void innerInsertAt(struct RangeTreeNode *inner, size_t pos,
+                          uintptr_t pivot, struct RangeTreeNode *child) {
+  for (size_t j = inner->count; j > pos; --j) {
+    inner->i.child[j] = inner->i.child[j - 1];
+    inner->i.pivot[j - 1] = inner->i.pivot[j - 2];
+  }
+  inner->i.child[pos] = child;
+  inner->i.pivot[pos - 1] = pivot;
+  inner->count++;
+}
+
+struct RangeTreeSpares {
+  struct RangeTreeNode *nodes[RANGE_TREE_MAX_HEIGHT + 1];
+  size_t count;
+};
+
+static struct RangeTreeNode *takeSpare(struct RangeTreeSpares *spares,
+                                       bool leaf) {
+  struct RangeTreeNode *node = spares->nodes[--spares->count];
+  memset(node, 0, sizeof(*node));
+  node->leaf = leaf;
+  return node;
+}
+
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Insert
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Insert below node; if node had to split, returns the new right sibling and
+// its lowest key in *sep
+static struct RangeTreeNode *insertIn(struct RangeTreeNode *node,
+                                      uintptr_t start, uintptr_t end,
+                                      void *value, uintptr_t *sep,
+                                      struct RangeTreeSpares *spares) {
+  if (node->leaf) {
+    size_t pos = 0;
+    while (pos < node->count && node->l.start[pos] < start)
+      pos++;
+
+    if (node->count < RANGE_TREE_LEAF_SLOTS) {
+      leafInsertAt(node, pos, start, end, value);
+      return NULL;
+    }
+
+    // full: move the upper half to a new leaf, then insert into either side
+    size_t half = RANGE_TREE_LEAF_SLOTS / 2;
+    struct RangeTreeNode *right = takeSpare(spares, true);
+    for (size_t j = half; j < RANGE_TREE_LEAF_SLOTS; ++j) {
+      right->l.start[j - half] = node->l.start[j];
+      right->l.end[j - half] = node->l.end[j];
+      right->l.value[j - half] = node->l.value[j];
+    }
+    right->count = RANGE_TREE_LEAF_SLOTS - half;
+    node->count = half;
+
+    if (pos <= half)
+      leafInsertAt(node, pos, start, end, value);
+    else
+      leafInsertAt(right, pos - half, start, end, value);
+
+    *sep = right->l.start[0];
+    return right;
+  }
+
+  size_t k = childIndex(node, start);
+  uintptr_t childSep;
+  struct RangeTreeNode *newChild =
+      insertIn(node->i.child[k], start, end, value, &childSep, spares);
+  if (!newChild)
+    return NULL;
+
+  if (node->count < RANGE_TREE_INNER_SLOTS) {
+    innerInsertAt(node, k + 1, childSep, newChild);
+    return NULL;
+  }
+
+  // full: the left keeps half the children, the pivot between the halves
+  // moves up, the right takes the rest
+  size_t half = (RANGE_TREE_INNER_SLOTS + 1) / 2;
+  struct RangeTreeNode *right = takeSpare(spares, false);
+  for (size_t j = half; j < RANGE_TREE_INNER_SLOTS; ++j) {
+    right->i.child[j - half] = node->i.child[j];
+    if (j + 1 < RANGE_TREE_INNER_SLOTS)
+      right->i.pivot[j - half] = node->i.pivot[j];
+  }
+  right->count = RANGE_TREE_INNER_SLOTS - half;
+  node->count = half;
+  *sep = node->i.pivot[half - 1];
+
+  if (k + 1 <= half)
+    innerInsertAt(node, k + 1, childSep, newChild);
+  else
+    innerInsertAt(right, k + 1 - half, childSep, newChild);
+
+  return right;
+}
+
+bool rangeTreeInsert(struct RangeTree *tree, uintptr_t start, uintptr_t end,
+                     void *value) {
+  if (start >= end || tree->height >= RANGE_TREE_MAX_HEIGHT)
+    return false;
+
+  // take every node a split could need up front, so running out of memory
+  // halfway can't leave the tree half-split
+  struct RangeTreeSpares spares = {.count = 0};
+  size_t need = tree->height + 1;
+  while (spares.count < need) {
+    struct RangeTreeNode *node = mempoolAlloc(&rangeTreeNodePool);
+    if (!node) {
+      printfError("range-tree: out of memory inserting 0x%lx-0x%lx\n", start,
+                  end);
+      while (spares.count > 0)
+        mempoolFree(&rangeTreeNodePool, spares.nodes[--spares.count]);
+      return false;
+    }
+    spares.nodes[spares.count++] = node;
+  }
+
+  if (!tree->root) {
+    tree->root = takeSpare(&spares, true);
+    tree->height = 1;
+  }
+
+  uintptr_t sep;
+  struct RangeTreeNode *right =
+      insertIn(tree->root, start, end, value, &sep, &spares);
+  if (right) {
+    struct RangeTreeNode *newRoot = takeSpare(&spares, false);
+    newRoot->i.child[0] = tree->root;
+    newRoot->i.child[1] = right;
+    newRoot->i.pivot[0] = sep;
+    newRoot->count = 2;
+    tree->root = newRoot;
+    tree->height++;
+  }
+  tree->count++;
+
+  while (spares.count > 0)
+    mempoolFree(&rangeTreeNodePool, spares.nodes[--spares.count]);
+  return true;
+}
+
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Remove
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void *removeIn(struct RangeTreeNode *node, uintptr_t start,
+                      bool *removed) {
+  if (node->leaf) {
+    for (size_t j = 0; j < node->count; ++j) {
+      if (node->l.start[j] != start)
+        continue;
+
+      void *value = node->l.value[j];
+      for (size_t m = j + 1; m < node->count; ++m) {
+        node->l.start[m - 1] = node->l.start[m];
+        node->l.end[m - 1] = node->l.end[m];
+        node->l.value[m - 1] = node->l.value[m];
+      }
+      node->count--;
+      *removed = true;
+      return value;
+    }
+    return NULL;
+  }
+
+  size_t k = childIndex(node, start);
+  struct RangeTreeNode *child = node->i.child[k];
+  void *value = removeIn(child, start, removed);
+  if (child->count > 0)
+    return value;
+
+  // drop the empty child together with the pivot on one side of it
+  mempoolFree(&rangeTreeNodePool, child);
+  for (size_t j = k + 1; j < node->count; ++j)
+    node->i.child[j - 1] = node->i.child[j];
+  size_t firstPivot = k > 0 ? k - 1 : 0;
+  for (size_t j = firstPivot + 1; j + 1 < node->count; ++j)
+    node->i.pivot[j - 1] = node->i.pivot[j];
+  node->count--;
+  return value;
+}
+
+void *rangeTreeRemove(struct RangeTree *tree, uintptr_t start) {
+  if (!tree->root)
+    return NULL;
+
+  bool removed = false;
+  void *value = removeIn(tree->root, start, &removed);
+  if (!removed)
+    return NULL;
+  tree->count--;
+
+  if (tree->root->count == 0) {
+    mempoolFree(&rangeTreeNodePool, tree->root);
+    tree->root = NULL;
+    tree->height = 0;
+    return value;
+  }
+
+  // an inner root left with one child is just an extra level
+  while (!tree->root->leaf && tree->root->count == 1) {
+    struct RangeTreeNode *old = tree->root;
+    tree->root = old->i.child[0];
+    tree->height--;
+    mempoolFree(&rangeTreeNodePool, old);
+  }
+  return value;
+}
+
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lookup
+// ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void *rangeTreeLookup(struct RangeTree *tree, uintptr_t addr) {
+  struct RangeTreeNode *node = tree->root;
+  struct RangeTreeNode *before = NULL; // closest subtree entirely below node
+  if (!node)
+    return NULL;
+
+  while (!node->leaf) {
+    size_t k = childIndex(node, addr);
+    if (k > 0)
+      before = node->i.child[k - 1];
+    node = node->i.child[k];
+  }
+
+  // the range with the greatest start <= addr is the only candidate
+  size_t j = node->count;
+  while (j > 0 && node->l.start[j - 1] > addr)
+    j--;
+
+  if (j == 0) {
+    // every key here is above addr: the candidate is the last range of the
+    // subtree just before this leaf
+    if (!before)
+      return NULL;
+    node = before;
+    while (!node->leaf)
+      node = node->i.child[node->count - 1];
+    j = node->count;
+  }
+
+  if (addr < node->l.end[j - 1])
+    return node->l.value[j - 1];
+  return NULL;
+}
+
+static void destroyIn(struct RangeTreeNode *node) {
+  if (!node->leaf) {
+    for (size_t k = 0; k < node->count; ++k)
+      destroyIn(node->i.child[k]);
+  }
+  mempoolFree(&rangeTreeNodePool, node);
+}
+
+void rangeTreeDestroy(struct RangeTree *tree) {
+  if (tree->root)
+    destroyIn(tree->root);
+  rangeTreeInit(tree);
+}
\ No newline at end of file
@@ -1,268 +1,871 @@
 #include <stdint.h>
 
+#include <arch-hook.h>
 #include <cpu/topology.h>
 #include <mm/hhdm.h>
 #include <mm/pmm.h>
+#include <mm/slub.h>
 #include <mm/zone.h>
 #include <printf.h>
+#include <spinlock.h>
+#include <stdmem.h>
 
 /* Configuration */
 #define SLUB_PAGE_SIZE 4096U
 #define SLUB_MIN_OBJ    8U         // minimum object size (bytes)
-#define SLUB_MAX_OBJ    (SLUB_PAGE_SIZE / 2) // above this -> allocate whole pages
+#define SLUB_MIN_SHIFT  3U         // log2(SLUB_MIN_OBJ)
+#define SLUB_MIN_ALIGN  8U         // minimum object alignment (bytes)
+#define SLUB_MAX_OBJ    6144U      // above this -> allocate whole pages
+#define SLUB_MAX_ORDER  3U         // largest slab is SLUB_PAGE_SIZE << SLUB_MAX_ORDER
+#define SLUB_CACHE_LINE 64U        // colour step (bytes)
+#define SLUB_MAGAZINE_SIZE 14U     // rounds per magazine (a magazine is 128 bytes)
 #define SLUB_ALIGN(x,a) (((x) + ((a)-1)) & ~((a)-1))
 
-/* Size classes: powers of two starting at 8 up to SLUB_MAX_OBJ (inclusive) */
+/* Size classes: powers of two from 8, plus the 1.5x steps in between from 64 up,
+   so no request wastes more than a third of its slot. Must stay sorted. */
 static const size_t slubSizeClasses[] = {
-    8, 16, 32, 64, 128, 256, 512, 1024, 2048
+    8, 16, 32, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+    4096, 6144
 };
 #define SLUB_SIZECLASS_COUNT (sizeof(slubSizeClasses)/sizeof(slubSizeClasses[0]))
 
-/* === Metadata stored at start of each slab page (kept in physical memory at page base) ===
-   We will place the SlubPageHeader at the start of a page (physical paddr).
-   To modify/read it we map the page via hhdmAddAddr(paddr) to a virtual pointer.
+/* size -> class lookup, one entry per SLUB_MIN_OBJ step: slubSizeIndex[(size - 1) >> SLUB_MIN_SHIFT] */
+#define SLUB_SIZEINDEX_COUNT (SLUB_MAX_OBJ >> SLUB_MIN_SHIFT)
+static uint8_t slubSizeIndex[SLUB_SIZEINDEX_COUNT];
+
+/* === Metadata stored at start of each slab ===
+   A slab is one pageAlloc() block of 2^order pages; the SlubPageHeader sits at the start
+   of its first page, found again through pageBlockBase(). Slabs, objects and freelist
+   links are all direct-map (HHDM) virtual addresses; physical addresses only appear at
+   the pageAlloc()/pageFree() boundary and in the slubAlloc()/slubFree() wrappers.
+   An object never starts at its slab base (the header is there), so a pointer that is
+   the base of its page block is a large allocation.
 */
 typedef struct SlubPageHeader {
-    uint32_t magic;            // for sanity checking
-    uint32_t objSize;          // size of objects on this page (bytes)
-    uint32_t totalObjects;     // how many objects fit (computed)
-    uint32_t freeCount;        // current free count
-    uintptr_t nextPagePaddr;   // physical address of next Slub page for this cache (0 if none)
-    uintptr_t freelistPaddr;   // physical address of first free object in this page (0 if none)
-    // padding to make header small and aligned
+    uint32_t magic;                 // for sanity checking
+    uint32_t objSize;               // size of objects on this page (bytes)
+    uint32_t totalObjects;          // how many objects fit (computed)
+    uint32_t freeCount;             // current free count
+    struct SlubPageHeader *nextPage; // next slab of this cache (NULL if none)
+    void *freelist;                 // first free object in this slab (NULL if none)
+    struct SlubCache *cache;        // owning cache
 } SlubPageHeader;
 
 #define SLUB_MAGIC 0x53504C55 /* 'SPLU' */
 
-/* A SlubCache per size-class */
+/* === Magazine layer (Bonwick) ===
+   Each CPU keeps a loaded and a previous magazine of free object pointers per cache and
+   allocates/frees against them without touching slab pages. When both run dry (or full)
+   the CPU trades a whole magazine with the cache's depot, so objects freed on one CPU are
+   handed to another as full magazines. Objects sitting in a magazine are still allocated
+   as far as their slab is concerned.
+*/
+typedef struct SlubMagazine {
+    struct SlubMagazine *next; // depot list link
+    uint64_t rounds;           // objects currently held
+    void *objs[SLUB_MAGAZINE_SIZE];
+} SlubMagazine;
+
+typedef struct SlubCpuCache {
+    SlubMagazine *loaded;
+    SlubMagazine *previous;
+} SlubCpuCache;
+
+/* A SlubCache per size-class, plus one per named object cache */
 typedef struct SlubCache {
-    size_t objSize;
-    uintptr_t pageListPaddr; // linked list of pages (physical addresses)
+    const char *name;
+    size_t objSize;          // object size requested by the cache owner
+    size_t objStride;        // distance between two objects on a slab
+    size_t objOffset;        // offset of the first object from the slab base
+    size_t freeOffset;       // where the freelist link is stored inside an object
+    size_t slabSize;         // SLUB_PAGE_SIZE << order
+    uint32_t order;          // pageAlloc() order of each slab
+    uint32_t objsPerPage;    // objects per slab
+    size_t colourAlign;      // colour step, at least a cache line
+    uint32_t colourCount;    // how many distinct colours the slab's slack allows
+    uint32_t colourNext;     // colour of the next slab
+    void (*ctor)(void *obj);
+    SlubPageHeader *pageList; // linked list of slabs
+    struct Spinlock lock;    // protects the slab lists and their freelists
+    struct SlubCache *next;  // all caches, for stats
+
+    bool useMagazines;
+    SlubCpuCache cpu[CPU_MAX];
+    struct Spinlock depotLock;
+    SlubMagazine *depotFull;
+    SlubMagazine *depotEmpty;
+    size_t depotFullCount;
+    size_t depotEmptyCount;
 } SlubCache;
 
 /* Global caches */
 static SlubCache gSlubCaches[SLUB_SIZECLASS_COUNT];
+static SlubCache gSlubCacheCache;    // backs the SlubCache descriptors themselves
+static SlubCache gSlubMagazineCache; // backs the magazines
+static SlubCache *gSlubCacheList = NULL;
+static struct Spinlock gSlubCacheListLock = SPINLOCK_INIT;
 static bool gSlubInitialized = false;
 
 /* Helper: select size-class index for requested size */
 static int slubSizeToIndex(size_t size) {
     size_t need = size;
     if (need < SLUB_MIN_OBJ) need = SLUB_MIN_OBJ;
-    for (int i = 0; i < (int)SLUB_SIZECLASS_COUNT; ++i) {
-        if (need <= slubSizeClasses[i]) return i;
+    if (need > SLUB_MAX_OBJ) return -1;
+    return slubSizeIndex[(need - 1) >> SLUB_MIN_SHIFT];
+}
+
+/* Helper: fill slubSizeIndex from slubSizeClasses */
+static void slubBuildSizeIndex(void) {
+    size_t cls = 0;
+    for (size_t i = 0; i < SLUB_SIZEINDEX_COUNT; ++i) {
+        size_t size = (i + 1) << SLUB_MIN_SHIFT;
+        while (slubSizeClasses[cls] < size) cls++;
+        slubSizeIndex[i] = (uint8_t)cls;
     }
-    return -1;
 }
 
-/* Helper: allocate a new page (physical paddr) for a given cache and initialize header+freelist */
-static uintptr_t slubAllocNewPageForCache(SlubCache *cache) {
-    // request one page from zone normal
-    uintptr_t pagePaddr = (uintptr_t) pageAlloc(ZONE_NORMAL, 1);
-    if (pagePaddr == 0) {
-        printf("slub: pageAlloc failed for size %zu\n", cache->objSize);
-        return 0;
+/* Helper: pick the smallest slab order whose tail waste is at most 1/fraction of the slab,
+   relaxing the fraction until something fits; returns false if no order holds an object */
+static bool slubCalculateOrder(SlubCache *cache) {
+    static const size_t fractions[] = { 16, 8, 4 };
+
+    for (size_t f = 0; f < sizeof(fractions) / sizeof(fractions[0]); ++f) {
+        for (uint32_t order = 0; order <= SLUB_MAX_ORDER; ++order) {
+            size_t slabSize = (size_t)SLUB_PAGE_SIZE << order;
+            if (cache->objOffset + cache->objStride > slabSize) continue;
+
+            size_t usable = slabSize - cache->objOffset;
+            size_t waste = usable % cache->objStride;
+            if (waste * fractions[f] > slabSize) continue;
+
+            cache->order = order;
+            cache->slabSize = slabSize;
+            cache->objsPerPage = (uint32_t)(usable / cache->objStride);
+            return true;
+        }
     }
 
-    // map to virtual to initialize
-    void *v = (void *) hhdmAddAddr(pagePaddr);
-    if (!v) {
-        printf("slub: hhdmAddAddr failed for pagePaddr %p\n", (void *)pagePaddr);
-        return 0;
+    // nothing is tight enough: take the biggest slab if an object fits at all
+    size_t slabSize = (size_t)SLUB_PAGE_SIZE << SLUB_MAX_ORDER;
+    if (cache->objOffset + cache->objStride > slabSize) return false;
+    cache->order = SLUB_MAX_ORDER;
+    cache->slabSize = slabSize;
+    cache->objsPerPage = (uint32_t)((slabSize - cache->objOffset) / cache->objStride);
+    return true;
+}
+
+/* Helper: compute slab layout for a cache; returns false if one object doesn't fit a slab */
+static bool slubCacheSetup(SlubCache *cache, const char *name, size_t size, size_t align,
+                           void (*ctor)(void *obj)) {
+    if (align < SLUB_MIN_ALIGN) align = SLUB_MIN_ALIGN;
+    if (size < SLUB_MIN_OBJ) size = SLUB_MIN_OBJ;
+
+    cache->name = name;
+    cache->objSize = size;
+    cache->ctor = ctor;
+    cache->pageList = NULL;
+    spinInit(&cache->lock);
+
+    cache->useMagazines = true;
+    for (size_t i = 0; i < CPU_MAX; ++i) {
+        cache->cpu[i].loaded = NULL;
+        cache->cpu[i].previous = NULL;
+    }
+    spinInit(&cache->depotLock);
+    cache->depotFull = NULL;
+    cache->depotEmpty = NULL;
+    cache->depotFullCount = 0;
+    cache->depotEmptyCount = 0;
+
+    // A constructed object must survive sitting on the freelist, so caches with a
+    // constructor keep the freelist link right after the object instead of inside it.
+    if (ctor) {
+        cache->freeOffset = SLUB_ALIGN(size, sizeof(void *));
+        cache->objStride = SLUB_ALIGN(cache->freeOffset + sizeof(void *), align);
+    } else {
+        cache->freeOffset = 0;
+        cache->objStride = SLUB_ALIGN(size, align);
+    }
+
+    cache->objOffset = SLUB_ALIGN(sizeof(SlubPageHeader), align);
+    if (!slubCalculateOrder(cache)) return false;
+
+    // Slack left at the end of a slab shifts the object area of successive slabs by
+    // one colour step each, so object N of different slabs lands in different cache sets.
+    size_t slack = cache->slabSize - cache->objOffset - (size_t)cache->objsPerPage * cache->objStride;
+    cache->colourAlign = align > SLUB_CACHE_LINE ? align : SLUB_CACHE_LINE;
+    cache->colourCount = (uint32_t)(slack / cache->colourAlign) + 1;
+    cache->colourNext = 0;
+
+    spinLock(&gSlubCacheListLock);
+    cache->next = gSlubCacheList;
+    gSlubCacheList = cache;
+    spinUnlock(&gSlubCacheListLock);
+    return true;
+}
+
+/* Helper: the freelist link stored inside a free object */
+static inline void **slubFreeLink(SlubCache *cache, void *obj) {
+    return (void **)((uintptr_t)obj + cache->freeOffset);
+}
+
+/* Helper: allocate a new slab for a given cache and initialize header+freelist */
+static SlubPageHeader *slubAllocNewPageForCache(SlubCache *cache) {
+    // request one 2^order page block from zone normal
+    void *pagePaddr = pageAlloc(ZONE_NORMAL, (size_t)1 << cache->order);
+    if (pagePaddr == NULL) {
+        printf("slub: pageAlloc failed for size %zu\n", cache->objSize);
+        return NULL;
     }
 
-    SlubPageHeader *hdr = (SlubPageHeader *) v;
+    SlubPageHeader *hdr = (SlubPageHeader *) hhdmAdd(pagePaddr);
     hdr->magic = SLUB_MAGIC;
     hdr->objSize = (uint32_t) cache->objSize;
+    hdr->cache = cache;
 
-    // header consumes some bytes; we align object area after header to object's alignment
-    size_t headerSize = SLUB_ALIGN(sizeof(SlubPageHeader), 8);
-    size_t usable = SLUB_PAGE_SIZE - headerSize;
-    size_t objSize = SLUB_ALIGN(cache->objSize, 8);
-    uint32_t totalObjects = (uint32_t)(usable / objSize);
+    uint32_t totalObjects = cache->objsPerPage;
     hdr->totalObjects = totalObjects;
     hdr->freeCount = totalObjects;
-    hdr->nextPagePaddr = cache->pageListPaddr;
-    hdr->freelistPaddr = 0;
+    hdr->nextPage = cache->pageList;
+    hdr->freelist = NULL;
 
-    // build freelist (store physical addresses of each object in the object memory)
-    uintptr_t baseObjPaddr = pagePaddr + headerSize;
-    uintptr_t prevObjPaddr = 0;
+    // pick this slab's colour
+    size_t colour = (size_t)cache->colourNext * cache->colourAlign;
+    if (++cache->colourNext >= cache->colourCount) cache->colourNext = 0;
+
+    // build freelist, pushing onto a stack so the first object ends up on top
+    uintptr_t base = (uintptr_t)hdr + cache->objOffset + colour;
+    void *prev = NULL;
     for (uint32_t i = 0; i < totalObjects; ++i) {
-        uintptr_t objPaddr = baseObjPaddr + (uintptr_t)i * objSize;
-        // store next pointer (physical) at start of object memory
-        uintptr_t *slot = (uintptr_t *)((uintptr_t)v + headerSize + (uintptr_t)i * objSize);
-        // store as physical addresses, but since we're writing in mapped virtual memory,
-        // compute next object's physical address
-        *slot = prevObjPaddr; // we push onto a stack to create freelist
-        prevObjPaddr = objPaddr;
+        void *obj = (void *)(base + (uintptr_t)i * cache->objStride);
+        if (cache->ctor) cache->ctor(obj);
+        *slubFreeLink(cache, obj) = prev;
+        prev = obj;
     }
-    hdr->freelistPaddr = prevObjPaddr;
+    hdr->freelist = prev;
 
     // Link this page into cache
-    cache->pageListPaddr = pagePaddr;
+    cache->pageList = hdr;
 
 #ifndef NDEBUG
-    printfDebug("slub: new page 0x%lx for objSize %u total %u freelist 0x%lx\n",
-                (unsigned long)pagePaddr, hdr->objSize, hdr->totalObjects, (unsigned long)hdr->freelistPaddr);
+    printfDebug("slub: new slab %p (order %u, colour %zu) for %s objSize %u total %u freelist %p\n",
+                (void *)hdr, cache->order, colour, cache->name, hdr->objSize, hdr->totalObjects,
+                hdr->freelist);
 #endif
 
-    // done (keep page mapped; it's okay if remains mapped for now)
-    // Note: we don't unmap the page because we may need to touch it later; if desired we could hhdmRemoveAddr.
-    return pagePaddr;
+    return hdr;
+}
+
+/* Helper: pop one object from the first page of the cache that has one */
+static void *slubAllocFromCache(SlubCache *cache) {
+    // find a page with a free object
+    SlubPageHeader *hdr = cache->pageList;
+    while (hdr != NULL) {
+        if (hdr->magic != SLUB_MAGIC) {
+            // corrupted page? skip it (but warn)
+            printf("slub: warning: slab %p has bad magic\n", (void *)hdr);
+        } else if (hdr->freeCount > 0) {
+            break;
+        }
+        hdr = hdr->nextPage;
+    }
+
+    // if none found, allocate a new page and init freelist
+    if (hdr == NULL) {
+        hdr = slubAllocNewPageForCache(cache);
+        if (hdr == NULL) return NULL;
+    }
+
+    // Pop one object from this page's freelist
+    void *obj = hdr->freelist;
+    if (obj == NULL) {
+        // inconsistent: freeCount > 0 but freelist empty
+        printf("slub: inconsistent freelist on slab %p\n", (void *)hdr);
+        return NULL;
+    }
+    hdr->freelist = *slubFreeLink(cache, obj);
+    hdr->freeCount -= 1;
+
+#ifndef NDEBUG
+    printfDebug("slub: alloc obj %p (slab %p) size %u freeLeft %u\n",
+                obj, (void *)hdr, hdr->objSize, hdr->freeCount);
+#endif
+
+    return obj;
+}
+
+/* Helper: locate the slab page header of an object, NULL if it isn't a slab object.
+   Large allocations (the pointer is the base of its page block) return NULL quietly. */
+static SlubPageHeader *slubFindPageHeader(void *obj) {
+    // find slab base: the first page of the pageAlloc() block holding the object
+    void *objPaddr = hhdmRemove(obj);
+    void *pagePaddr = pageBlockBase(objPaddr);
+    if (pagePaddr == NULL) {
+        printf("slub: object %p is not in any page block\n", obj);
+        return NULL;
+    }
+    if (pagePaddr == objPaddr) return NULL;
+
+    SlubPageHeader *hdr = (SlubPageHeader *) hhdmAdd(pagePaddr);
+    if (hdr->magic != SLUB_MAGIC) {
+        printf("slub: object %p is inside non-slab page %p (magic=0x%x)\n",
+               obj, (void *)hdr, hdr->magic);
+        return NULL;
+    }
+    return hdr;
+}
+
+/* Helper: return a large (whole page block) allocation */
+static void slubFreeLarge(void *ptr) {
+    void *paddr = hhdmRemove(ptr);
+    if (pageBlockBase(paddr) != paddr) {
+        printf("slub: free of %p, which is not an allocated object\n", ptr);
+        return;
+    }
+
+#ifndef NDEBUG
+    printfDebug("slub: large free %p (%zu pages)\n", ptr, pageBlockPages(paddr));
+#endif
+    pageFree(paddr);
+}
+
+/* Helper: push an object back onto its page freelist */
+static void slubFreeToPage(SlubPageHeader *hdr, void *obj) {
+    SlubCache *cache = hdr->cache;
+
+    // store current freelist head into the object's freelist slot
+    *slubFreeLink(cache, obj) = hdr->freelist;
+    hdr->freelist = obj;
+    hdr->freeCount += 1;
+
+#ifndef NDEBUG
+    printfDebug("slub: free obj %p (slab %p) freeCount %u/%u\n",
+                obj, (void *)hdr, hdr->freeCount, hdr->totalObjects);
+#endif
+
+    // an empty slab stays on the cache for reuse; nothing hands slabs back to pageFree() yet
+}
+
+/* Helper: free a batch, looking a slab up only when the next object leaves the current one.
+   If expected is set, objects that belong to another cache are rejected; otherwise
+   large allocations in the batch are returned to the page allocator. */
+static void slubFreeBulkToCache(SlubCache *expected, size_t n, void **ptrs) {
+    SlubPageHeader *hdr = NULL;
+    SlubCache *locked = NULL;
+    uintptr_t slabStart = 0, slabEnd = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        void *obj = ptrs[i];
+        if (obj == NULL) continue;
+
+        if (!hdr || (uintptr_t)obj < slabStart || (uintptr_t)obj >= slabEnd) {
+            hdr = slubFindPageHeader(obj);
+            if (!hdr) {
+                if (!expected) slubFreeLarge(obj);
+                continue;
+            }
+
+            if (expected && hdr->cache != expected) {
+                printf("slub: object %p freed to cache %s but belongs to %s\n",
+                       obj, expected->name, hdr->cache->name);
+                hdr = NULL;
+                continue;
+            }
+
+            if (hdr->cache != locked) {
+                if (locked) spinUnlock(&locked->lock);
+                locked = hdr->cache;
+                spinLock(&locked->lock);
+            }
+
+            slabStart = (uintptr_t) hdr;
+            slabEnd = slabStart + hdr->cache->slabSize;
+        }
+
+        *slubFreeLink(hdr->cache, obj) = hdr->freelist;
+        hdr->freelist = obj;
+        hdr->freeCount += 1;
+    }
+    if (locked) spinUnlock(&locked->lock);
+
+#ifndef NDEBUG
+    printfDebug("slub: bulk free %zu objects\n", n);
+#endif
+}
+
+/* Helper: pop n objects, draining one slab's freelist at a time; all or nothing */
+static size_t slubAllocBulkFromCache(SlubCache *cache, size_t n, void **out) {
+    size_t done = 0;
+    spinLock(&cache->lock);
+    SlubPageHeader *next = cache->pageList;
+
+    while (done < n) {
+        // find the next slab with free objects, growing the cache when we run out
+        SlubPageHeader *hdr = next;
+        bool fresh = false;
+        while (hdr != NULL && (hdr->magic != SLUB_MAGIC || hdr->freeCount == 0))
+            hdr = hdr->nextPage;
+        if (hdr == NULL) {
+            hdr = slubAllocNewPageForCache(cache);
+            if (hdr == NULL) break;
+            fresh = true;
+        }
+
+        // drain this slab without leaving it
+        while (done < n && hdr->freeCount > 0) {
+            void *obj = hdr->freelist;
+            if (obj == NULL) {
+                printf("slub: inconsistent freelist on slab %p\n", (void *)hdr);
+                break;
+            }
+            hdr->freelist = *slubFreeLink(cache, obj);
+            hdr->freeCount -= 1;
+            out[done++] = obj;
+        }
+
+        // a fresh slab is linked at the head, everything behind it was already full
+        next = fresh ? NULL : hdr->nextPage;
+    }
+    spinUnlock(&cache->lock);
+
+    if (done < n) {
+        slubFreeBulkToCache(cache, done, out);
+        return 0;
+    }
+
+#ifndef NDEBUG
+    printfDebug("slub: bulk alloc %zu objects from %s\n", n, cache->name);
+#endif
+    return n;
+}
+
+/* Helper: slab-layer alloc/free under the cache lock */
+static void *slubSlabAlloc(SlubCache *cache) {
+    spinLock(&cache->lock);
+    void *obj = slubAllocFromCache(cache);
+    spinUnlock(&cache->lock);
+    return obj;
+}
+
+static void slubSlabFree(SlubCache *cache, SlubPageHeader *hdr, void *obj) {
+    spinLock(&cache->lock);
+    slubFreeToPage(hdr, obj);
+    spinUnlock(&cache->lock);
+}
+
+/* Helper: a new, empty magazine, NULL when out of memory */
+static SlubMagazine *slubMagazineNew(void) {
+    SlubMagazine *mag = (SlubMagazine *) slubSlabAlloc(&gSlubMagazineCache);
+    if (mag == NULL) return NULL;
+
+    mag->next = NULL;
+    mag->rounds = 0;
+    return mag;
+}
+
+/* Helper: depot list push/pop, depotLock held */
+static void slubDepotPush(SlubMagazine **list, size_t *count, SlubMagazine *mag) {
+    mag->next = *list;
+    *list = mag;
+    (*count)++;
+}
+
+static SlubMagazine *slubDepotPop(SlubMagazine **list, size_t *count) {
+    SlubMagazine *mag = *list;
+    if (!mag) return NULL;
+    *list = mag->next;
+    (*count)--;
+    return mag;
+}
+
+/* Helper: take an object from cpuIndex's magazines; NULL means go to the slab layer */
+static void *slubMagazineAlloc(SlubCache *cache, uint32_t cpuIndex) {
+    SlubCpuCache *cc = &cache->cpu[cpuIndex];
+
+    for (;;) {
+        if (cc->loaded && cc->loaded->rounds > 0)
+            return cc->loaded->objs[--cc->loaded->rounds];
+
+        if (cc->previous && cc->previous->rounds > 0) {
+            SlubMagazine *tmp = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = tmp;
+            continue;
+        }
+
+        // both magazines are empty: trade previous for a full one from the depot
+        spinLock(&cache->depotLock);
+        SlubMagazine *full = slubDepotPop(&cache->depotFull, &cache->depotFullCount);
+        if (full && cc->previous)
+            slubDepotPush(&cache->depotEmpty, &cache->depotEmptyCount, cc->previous);
+        spinUnlock(&cache->depotLock);
+
+        if (!full) return NULL;
+        cc->previous = cc->loaded;
+        cc->loaded = full;
+    }
+}
+
+/* Helper: put an object into cpuIndex's magazines; false means free it to the slab layer */
+static bool slubMagazineFree(SlubCache *cache, uint32_t cpuIndex, void *obj) {
+    SlubCpuCache *cc = &cache->cpu[cpuIndex];
+
+    for (;;) {
+        if (cc->loaded && cc->loaded->rounds < SLUB_MAGAZINE_SIZE) {
+            cc->loaded->objs[cc->loaded->rounds++] = obj;
+            return true;
+        }
+
+        if (cc->previous && cc->previous->rounds == 0) {
+            SlubMagazine *tmp = cc->loaded;
+            cc->loaded = cc->previous;
+            cc->previous = tmp;
+            continue;
+        }
+
+        // loaded is full (or missing) and previous is full: hand previous to the depot
+        // and load an empty magazine
+        spinLock(&cache->depotLock);
+        SlubMagazine *empty = slubDepotPop(&cache->depotEmpty, &cache->depotEmptyCount);
+        spinUnlock(&cache->depotLock);
+
+        if (!empty) empty = slubMagazineNew();
+        if (!empty) return false;
+
+        if (cc->previous) {
+            spinLock(&cache->depotLock);
+            slubDepotPush(&cache->depotFull, &cache->depotFullCount, cc->previous);
+            spinUnlock(&cache->depotLock);
+        }
+        cc->previous = cc->loaded;
+        cc->loaded = empty;
+    }
+}
+
+/* Helper: the allocation path every single-object API goes through */
+static void *slubCacheAllocObject(SlubCache *cache) {
+    if (cache->useMagazines) {
+        void *obj = slubMagazineAlloc(cache, cpuGetID());
+        if (obj) return obj;
+    }
+    return slubSlabAlloc(cache);
+}
+
+/* Helper: the free path every single-object API goes through; hdr may be NULL if unknown */
+static void slubCacheFreeObject(SlubCache *cache, SlubPageHeader *hdr, void *obj) {
+    if (cache->useMagazines && slubMagazineFree(cache, cpuGetID(), obj))
+        return;
+
+    if (!hdr) hdr = slubFindPageHeader(obj);
+    if (!hdr) return;
+    slubSlabFree(cache, hdr, obj);
 }
 
 /* Initialize global caches */
 void slubInit(void) {
     if (gSlubInitialized) return;
+    slubBuildSizeIndex();
     for (size_t i = 0; i < SLUB_SIZECLASS_COUNT; ++i) {
-        gSlubCaches[i].objSize = slubSizeClasses[i];
-        gSlubCaches[i].pageListPaddr = 0;
+        slubCacheSetup(&gSlubCaches[i], "size-class", slubSizeClasses[i], SLUB_MIN_ALIGN, NULL);
     }
+    slubCacheSetup(&gSlubCacheCache, "slub-cache", sizeof(SlubCache), SLUB_MIN_ALIGN, NULL);
+    slubCacheSetup(&gSlubMagazineCache, "slub-magazine", sizeof(SlubMagazine), SLUB_MIN_ALIGN, NULL);
+    gSlubCacheCache.useMagazines = false;
+    gSlubMagazineCache.useMagazines = false;
     gSlubInitialized = true;
 #ifndef NDEBUG
     printfDebug("slub: initialized %zu size classes\n", (size_t)SLUB_SIZECLASS_COUNT);
 #endif
 }
 
-/* Allocate: returns physical address as void* */
-void *slubAlloc(size_t size) {
+void *kmalloc(size_t size) {
     if (!gSlubInitialized) slubInit();
     if (size == 0) size = 1;
 
-    // If too large for slab, allocate whole pages and return page base paddr
-    if (size > SLUB_MAX_OBJ) {
-        // compute page count
-        size_t pagesNeeded = (size + SLUB_PAGE_SIZE - 1) / SLUB_PAGE_SIZE;
-        uintptr_t paddr = (uintptr_t) pageAlloc(ZONE_NORMAL, (size_t)pagesNeeded);
-        if (paddr == 0) {
-            printf("slub: large alloc pageAlloc failed for size %zu\n", size);
-            return NULL;
-        }
+    int idx = slubSizeToIndex(size);
+    if (idx >= 0) return slubCacheAllocObject(&gSlubCaches[idx]);
+
+    // too large for a slab: allocate whole pages and return the block base
+    size_t pagesNeeded = (size + SLUB_PAGE_SIZE - 1) / SLUB_PAGE_SIZE;
+    void *paddr = pageAlloc(ZONE_NORMAL, pagesNeeded);
+    if (paddr == NULL) {
+        printf("slub: large alloc pageAlloc failed for size %zu\n", size);
+        return NULL;
+    }
 #ifndef NDEBUG
-        printfDebug("slub: large alloc size %zu -> paddr 0x%lx (%zu pages)\n",
-                    size, (unsigned long)paddr, pagesNeeded);
+    printfDebug("slub: large alloc size %zu -> %p (%zu pages)\n", size, hhdmAdd(paddr), pagesNeeded);
 #endif
-        return (void *) paddr;
+    return hhdmAdd(paddr);
+}
+
+void kfree(void *ptr) {
+    if (ptr == NULL) return;
+
+    SlubPageHeader *hdr = slubFindPageHeader(ptr);
+    if (!hdr) {
+        slubFreeLarge(ptr);
+        return;
     }
 
+    slubCacheFreeObject(hdr->cache, hdr, ptr);
+}
+
+void kfreeSized(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+    if (size == 0) size = 1;
+
     int idx = slubSizeToIndex(size);
     if (idx < 0) {
-        // shouldn't happen due to earlier check, but fallback to pageAlloc
-        uintptr_t paddr = (uintptr_t) pageAlloc(ZONE_NORMAL, 1);
-        return (void *) paddr;
+#ifndef NDEBUG
+        slubFreeLarge(ptr);
+#else
+        pageFree(hhdmRemove(ptr));
+#endif
+        return;
     }
 
     SlubCache *cache = &gSlubCaches[idx];
-
-    // find a page with a free object
-    uintptr_t pagePaddr = cache->pageListPaddr;
     SlubPageHeader *hdr = NULL;
-    void *pageVaddr = NULL;
-    while (pagePaddr != 0) {
-        pageVaddr = (void *) hhdmAddAddr(pagePaddr);
-        if (!pageVaddr) {
-            printf("slub: hhdmAddAddr failed for page 0x%lx while searching\n", (unsigned long)pagePaddr);
-            return NULL;
-        }
-        hdr = (SlubPageHeader *) pageVaddr;
-        if (hdr->magic != SLUB_MAGIC) {
-            // corrupted page? skip it (but warn)
-            printf("slub: warning: page 0x%lx has bad magic\n", (unsigned long)pagePaddr);
-            pagePaddr = hdr->nextPagePaddr;
-            continue;
-        }
-        if (hdr->freeCount > 0) break;
-        // else move to next
-        pagePaddr = hdr->nextPagePaddr;
-        // leave mapped page mapped for now
-    }
 
-    // if none found, allocate a new page and init freelist
-    if (pagePaddr == 0) {
-        pagePaddr = slubAllocNewPageForCache(cache);
-        if (pagePaddr == 0) {
-            return NULL;
-        }
-        pageVaddr = (void *) hhdmAddAddr(pagePaddr);
-        hdr = (SlubPageHeader *) pageVaddr;
+#ifndef NDEBUG
+    // the size picks the cache; make sure it is the one the object really came from
+    hdr = slubFindPageHeader(ptr);
+    if (!hdr) {
+        printf("slub: sized free of %p (%zu bytes), which is not a slab object\n", ptr, size);
+        return;
+    }
+    if (hdr->cache != cache) {
+        printf("slub: sized free of %p claims %zu bytes but the object is %zu bytes (%s)\n",
+               ptr, size, hdr->cache->objSize, hdr->cache->name);
+        return;
     }
+#endif
 
-    // Pop one object from this page's freelist
-    uintptr_t objPaddr = hdr->freelistPaddr;
-    if (objPaddr == 0) {
-        // inconsistent: freeCount > 0 but freelist empty
-        printf("slub: inconsistent freelist on page 0x%lx\n", (unsigned long)pagePaddr);
+    slubCacheFreeObject(cache, hdr, ptr);
+}
+
+size_t ksize(void *ptr) {
+    if (ptr == NULL) return 0;
+
+    SlubPageHeader *hdr = slubFindPageHeader(ptr);
+    if (hdr) return hdr->cache->objSize;
+
+    void *paddr = hhdmRemove(ptr);
+    if (pageBlockBase(paddr) != paddr) return 0;
+    return pageBlockPages(paddr) * SLUB_PAGE_SIZE;
+}
+
+void *krealloc(void *ptr, size_t size) {
+    if (ptr == NULL) return kmalloc(size);
+    if (size == 0) {
+        kfree(ptr);
         return NULL;
     }
 
-    // To get the next pointer stored inside the object, map object virtual
-    uintptr_t objVaddr = (uintptr_t) hhdmAddAddr(objPaddr);
-    if (!objVaddr) {
-        printf("slub: hhdmAddAddr failed for objPaddr 0x%lx\n", (unsigned long)objPaddr);
+    // the slot we already have may be big enough
+    size_t oldSize = ksize(ptr);
+    if (oldSize == 0) return NULL;
+    if (size <= oldSize) return ptr;
+
+    void *newPtr = kmalloc(size);
+    if (newPtr == NULL) return NULL;
+    memcpy(newPtr, ptr, oldSize);
+    kfree(ptr);
+    return newPtr;
+}
+
+/* Physical-address wrappers for callers that still hand addresses to hardware */
+void *slubAlloc(size_t size) {
+    void *ptr = kmalloc(size);
+    return ptr ? hhdmRemove(ptr) : NULL;
+}
+
+void slubFree(void *paddr) {
+    if (paddr == NULL) return;
+    kfree(hhdmAdd(paddr));
+}
+
+void slubFreeSized(void *paddr, size_t size) {
+    if (paddr == NULL) return;
+    kfreeSized(hhdmAdd(paddr), size);
+}
+
+/* Create a named cache; descriptors are themselves allocated from gSlubCacheCache */
+struct SlubCache *slubCacheCreate(const char *name, size_t size, size_t align,
+                                  void (*ctor)(void *obj)) {
+    if (!gSlubInitialized) slubInit();
+    if (size == 0) return NULL;
+    if (align & (align - 1)) {
+        printf("slub: cache %s: alignment %zu is not a power of two\n", name, align);
         return NULL;
     }
-    // next stored at object start
-    uintptr_t nextObjPaddr = *((uintptr_t *) objVaddr);
 
-    // update header
-    hdr->freelistPaddr = nextObjPaddr;
-    hdr->freeCount -= 1;
+    SlubCache *cache = (SlubCache *) slubSlabAlloc(&gSlubCacheCache);
+    if (cache == NULL) return NULL;
+
+    if (!slubCacheSetup(cache, name, size, align, ctor)) {
+        printf("slub: cache %s: object size %zu (align %zu) doesn't fit a slab\n",
+               name, size, align);
+        kfree(cache);
+        return NULL;
+    }
 
 #ifndef NDEBUG
-    printfDebug("slub: alloc obj 0x%lx (page 0x%lx) size %u freeLeft %u\n",
-                (unsigned long)objPaddr, (unsigned long)pagePaddr, hdr->objSize, hdr->freeCount);
+    printfDebug("slub: created cache %s objSize %zu stride %zu (%u per order-%u slab)\n",
+                cache->name, cache->objSize, cache->objStride, cache->objsPerPage, cache->order);
 #endif
+    return cache;
+}
 
-    // return physical address as void*
-    return (void *) objPaddr;
+void *slubCacheAlloc(struct SlubCache *cache) {
+    if (!cache) return NULL;
+    return slubCacheAllocObject(cache);
 }
 
-/* Free: accepts paddr (physical) */
-void slubFree(void *paddr) {
-    if (paddr == NULL) return;
-    uintptr_t objPaddr = (uintptr_t) paddr;
+void slubCacheFree(struct SlubCache *cache, void *obj) {
+    if (obj == NULL) return;
+    SlubPageHeader *hdr = NULL;
 
-    // find page base (align down to SLUB_PAGE_SIZE)
-    uintptr_t pagePaddr = objPaddr & ~(SLUB_PAGE_SIZE - 1);
+#ifndef NDEBUG
+    // release builds trust the caller and never touch the slab on the magazine path
+    hdr = slubFindPageHeader(obj);
+    if (!hdr) return;
 
-    // map page
-    void *pageVaddr = (void *) hhdmAddAddr(pagePaddr);
-    if (!pageVaddr) {
-        printf("slub: hhdmAddAddr failed for pagePaddr 0x%lx in free\n", (unsigned long)pagePaddr);
+    if (hdr->cache != cache) {
+        printf("slub: object %p freed to cache %s but belongs to %s\n",
+               obj, cache->name, hdr->cache->name);
         return;
     }
-    SlubPageHeader *hdr = (SlubPageHeader *) pageVaddr;
-    if (hdr->magic != SLUB_MAGIC) {
-        // Might be a large-allocation (page-based) where objPaddr == pagePaddr
-        // In our design we returned page base for large allocs, so free can't free page (not implemented)
-#ifndef NDEBUG
-        printfDebug("slub: free called on non-slab page 0x%lx (magic=0x%x) - ignoring\n",
-                    (unsigned long)pagePaddr, hdr->magic);
 #endif
-        // We don't support freeing whole-page allocations (page free not implemented).
-        return;
+
+    slubCacheFreeObject(cache, hdr, obj);
+}
+
+size_t slubAllocBulk(size_t size, size_t n, void **out) {
+    if (!gSlubInitialized) slubInit();
+    if (n == 0 || !out) return 0;
+    if (size == 0) size = 1;
+
+    int idx = slubSizeToIndex(size);
+    if (idx >= 0) return slubAllocBulkFromCache(&gSlubCaches[idx], n, out);
+
+    // large objects are whole page blocks anyway; nothing to batch
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = kmalloc(size);
+        if (!out[i]) {
+            slubFreeBulk(i, out);
+            return 0;
+        }
     }
+    return n;
+}
+
+void slubFreeBulk(size_t n, void **ptrs) {
+    if (n == 0 || !ptrs) return;
+    slubFreeBulkToCache(NULL, n, ptrs);
+}
+
+size_t slubCacheAllocBulk(struct SlubCache *cache, size_t n, void **out) {
+    if (!cache || n == 0 || !out) return 0;
+    return slubAllocBulkFromCache(cache, n, out);
+}
 
-    // push the object into the page freelist
-    uintptr_t objVaddr = (uintptr_t) hhdmAddAddr(objPaddr);
-    if (!objVaddr) {
-        printf("slub: hhdmAddAddr failed for objPaddr 0x%lx in free\n", (unsigned long)objPaddr);
+void slubCacheFreeBulk(struct SlubCache *cache, size_t n, void **ptrs) {
+    if (!cache || n == 0 || !ptrs) return;
+    slubFreeBulkToCache(cache, n, ptrs);
+}
+
+/* Helper: give every object in mag back to its slab, then free mag itself */
+static void slubMagazineRelease(SlubCache *cache, SlubMagazine *mag) {
+    while (mag->rounds > 0) {
+        void *obj = mag->objs[--mag->rounds];
+        SlubPageHeader *hdr = slubFindPageHeader(obj);
+        if (hdr) slubSlabFree(cache, hdr, obj);
+    }
+    SlubPageHeader *hdr = slubFindPageHeader(mag);
+    if (hdr) slubSlabFree(&gSlubMagazineCache, hdr, mag);
+}
+
+/* Helper: return one CPU's magazines and the whole depot to the slab layer */
+static void slubMagazineDrain(SlubCache *cache, uint32_t cpuIndex) {
+    SlubCpuCache *cc = &cache->cpu[cpuIndex];
+    if (cc->loaded) slubMagazineRelease(cache, cc->loaded);
+    if (cc->previous) slubMagazineRelease(cache, cc->previous);
+    cc->loaded = NULL;
+    cc->previous = NULL;
+
+    spinLock(&cache->depotLock);
+    SlubMagazine *full = cache->depotFull;
+    SlubMagazine *empty = cache->depotEmpty;
+    cache->depotFull = cache->depotEmpty = NULL;
+    cache->depotFullCount = cache->depotEmptyCount = 0;
+    spinUnlock(&cache->depotLock);
+
+    while (full) {
+        SlubMagazine *next = full->next;
+        slubMagazineRelease(cache, full);
+        full = next;
+    }
+    while (empty) {
+        SlubMagazine *next = empty->next;
+        slubMagazineRelease(cache, empty);
+        empty = next;
+    }
+}
+
+/* Producer/consumer benchmark: one CPU allocates batches, another frees them.
+   The plain path goes to the slab every time; the magazine path hands full magazines
+   from the consumer to the producer through the depot. Only the BSP runs, so both
+   sides are simulated from here by passing the CPU index explicitly. Build with
+   NDEBUG, otherwise the slab path's debug tracing dominates the numbers. */
+#define SLUB_BENCH_BATCH 64
+#define SLUB_BENCH_PRODUCER 0
+#define SLUB_BENCH_CONSUMER (CPU_MAX > 1 ? 1 : 0)
+
+void slubBenchMagazines(size_t iterations) {
+    static SlubCache *benchCache = NULL;
+    void *batch[SLUB_BENCH_BATCH];
+
+    if (!benchCache) benchCache = slubCacheCreate("slub-bench", 64, 0, NULL);
+    if (!benchCache) {
+        printfError("slub: bench: cannot create cache\n");
         return;
     }
 
-    // store current freelist head into object start
-    *((uintptr_t *) objVaddr) = hdr->freelistPaddr;
-    // update header
-    hdr->freelistPaddr = objPaddr;
-    hdr->freeCount += 1;
+    uint64_t start = archCycleCounter();
+    for (size_t it = 0; it < iterations; ++it) {
+        for (size_t i = 0; i < SLUB_BENCH_BATCH; ++i)
+            batch[i] = slubSlabAlloc(benchCache);
+        for (size_t i = 0; i < SLUB_BENCH_BATCH; ++i) {
+            SlubPageHeader *hdr = batch[i] ? slubFindPageHeader(batch[i]) : NULL;
+            if (hdr) slubSlabFree(benchCache, hdr, batch[i]);
+        }
+    }
+    uint64_t slabCycles = archCycleCounter() - start;
 
-#ifndef NDEBUG
-    printfDebug("slub: free obj 0x%lx (page 0x%lx) freeCount %u/%u\n",
-                (unsigned long)objPaddr, (unsigned long)pagePaddr,
-                hdr->freeCount, hdr->totalObjects);
-#endif
+    start = archCycleCounter();
+    for (size_t it = 0; it < iterations; ++it) {
+        for (size_t i = 0; i < SLUB_BENCH_BATCH; ++i) {
+            batch[i] = slubMagazineAlloc(benchCache, SLUB_BENCH_PRODUCER);
+            if (!batch[i]) batch[i] = slubSlabAlloc(benchCache);
+        }
+        for (size_t i = 0; i < SLUB_BENCH_BATCH; ++i) {
+            if (!batch[i] || slubMagazineFree(benchCache, SLUB_BENCH_CONSUMER, batch[i]))
+                continue;
+            SlubPageHeader *hdr = slubFindPageHeader(batch[i]);
+            if (hdr) slubSlabFree(benchCache, hdr, batch[i]);
+        }
+    }
+    uint64_t magazineCycles = archCycleCounter() - start;
+
+    // don't leave the bench's objects parked in either side's magazines
+    slubMagazineDrain(benchCache, SLUB_BENCH_PRODUCER);
+    slubMagazineDrain(benchCache, SLUB_BENCH_CONSUMER);
 
-    // Note: we don't free pages even if all objects are free since no pageFree exists
+    size_t ops = iterations * SLUB_BENCH_BATCH;
+    if (ops == 0) ops = 1;
+    printfInfo("slub: bench %zu alloc/free pairs: slab %lu cycles/pair, magazine %lu cycles/pair\n",
+               ops, (unsigned long)(slabCycles / ops), (unsigned long)(magazineCycles / ops));
 }
 
 void slubDumpStats() {
@@ -273,27 +876,22 @@ void slubDumpStats() {
 
     printfDebug("==== SLUB STATS DUMP BEGIN ====\n");
 
-    for (size_t i = 0; i < SLUB_SIZECLASS_COUNT; i++) {
-        SlubCache *cache = &gSlubCaches[i];
+    for (SlubCache *cache = gSlubCacheList; cache; cache = cache->next) {
+        printfDebug("Cache %s: objSize=%lu stride=%lu order=%u colours=%u\n", cache->name,
+                    (unsigned long)cache->objSize, (unsigned long)cache->objStride, cache->order,
+                    cache->colourCount);
 
-        if (cache->objSize == 0)
-            continue; // unused size class
-
-        printfDebug("Class[%lu]: objSize=%lu\n", (unsigned)i, (unsigned)cache->objSize);
-
-        uintptr_t pagePaddr = cache->pageListPaddr;
+        SlubPageHeader *hdr = cache->pageList;
         uint64_t pageCount = 0;
         uint64_t totalObjs = 0;
         uint64_t totalFree = 0;
 
-        while (pagePaddr != 0) {
+        while (hdr != NULL) {
             pageCount++;
 
-            SlubPageHeader *hdr = (SlubPageHeader*)hhdmAddAddr(pagePaddr);
-
 #ifndef NDEBUG
             if (hdr->magic != SLUB_MAGIC) {
-                printfDebug("  !! BAD PAGE MAGIC at 0x%lx\n", pagePaddr);
+                printfDebug("  !! BAD PAGE MAGIC at %p\n", (void *)hdr);
                 break;
             }
 #endif
@@ -301,16 +899,16 @@ void slubDumpStats() {
             totalObjs += hdr->totalObjects;
             totalFree += hdr->freeCount;
 
-            printfDebug("  page 0x%lx: objects=%lu free=%lu\n",
-                        pagePaddr,
+            printfDebug("  slab %p: objects=%lu free=%lu\n",
+                        (void *)hdr,
                         hdr->totalObjects,
                         hdr->freeCount);
 
-            pagePaddr = hdr->nextPagePaddr;
+            hdr = hdr->nextPage;
         }
 
-        printfDebug("  => pages=%lu, objects=%lu, free=%lu\n",
-                    pageCount, totalObjs, totalFree);
+        printfDebug("  => slabs=%lu, objects=%lu, free=%lu, depot full=%lu empty=%lu\n",
+                    pageCount, totalObjs, totalFree, cache->depotFullCount, cache->depotEmptyCount);
     }
 
     printfDebug("==== SLUB STATS DUMP END ====\n");
@@ -5,6 +5,7 @@
 #include <limine/limine.h>
 #include <macros.h>
 #include <mm/hhdm.h>
+#include <mm/hugepage.h>
 #include <mm/memmap.h>
 #include <mm/pmm.h>
 #include <mm/slub.h>
@@ -38,9 +39,12 @@ __noreturn void kboot() {
   memmapAbstract();
   memmapDump();
 
+  hugePoolCarve();
   pmmInit();
+  hugePoolInit();
   slubInit();
   vmmInit();
+  archPostInit();
 
   printfOk(
       "World End Destruction, Alternating Universe, Moving to KMAIN()!!\n");
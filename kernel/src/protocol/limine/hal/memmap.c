@@ -118,22 +118,31 @@ void memmapAbstract() {
   printfInfo("Now setting memmap global variables...\n");
 
   usable.entries = usableEntries;
+  usable.capacity = PER_TYPE_ENTRY_COUNT;
   usable.count = usableCount;
   bootloaderReclaimable.entries = bootloaderReclaimableEntries;
+  bootloaderReclaimable.capacity = PER_TYPE_ENTRY_COUNT;
   bootloaderReclaimable.count = bootloaderReclaimableCount;
   acpiReclaimable.entries = acpiReclaimableEntries;
+  acpiReclaimable.capacity = PER_TYPE_ENTRY_COUNT;
   acpiReclaimable.count = acpiReclaimableCount;
   acpiNvs.entries = acpiNvsEntries;
+  acpiNvs.capacity = PER_TYPE_ENTRY_COUNT;
   acpiNvs.count = acpiNvsCount;
   acpiTable.entries = acpiTableEntries;
+  acpiTable.capacity = PER_TYPE_ENTRY_COUNT;
   acpiTable.count = acpiTableCount;
   mmio.entries = mmioEntries;
+  mmio.capacity = PER_TYPE_ENTRY_COUNT;
   mmio.count = 0;
   reserved.entries = reservedEntries;
+  reserved.capacity = PER_TYPE_ENTRY_COUNT;
   reserved.count = reservedCount;
   badmem.entries = badmemEntries;
+  badmem.capacity = PER_TYPE_ENTRY_COUNT;
   badmem.count = badmemCount;
   unknown.entries = unknownEntries;
+  unknown.capacity = PER_TYPE_ENTRY_COUNT;
   unknown.count = unknownCount;
 
   memmap.entryTotalCount = totalCount;